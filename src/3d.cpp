@@ -41,7 +41,7 @@ template<typename V> V Rotation::rotate(V v) {
     return *this;
 }*/
 
-Photon Camera::emit_photon(int img_x, int img_y, double speed_of_light) {
+Photon Camera::emit_photon(double img_x, double img_y, double speed_of_light) {
     vec3 velocity;
     //set direction for fixed-size, variable-distance screen
     velocity.x = resolution_h / tan(FOV/2);
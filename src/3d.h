@@ -37,6 +37,10 @@ template <typename T1, typename T2> T1 dotprod(tvec3<T1> v1, tvec3<T2> v2) {
     return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z; 
 }
 
+template <typename T> tvec3<T> crossprod(tvec3<T> v1, tvec3<T> v2) { 
+    return tvec3<T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x); 
+}
+
 template <typename T> T abs(tvec3<T> v) {
     return sqrt(dotprod(v,v));
 }
@@ -76,7 +80,8 @@ struct Camera {
         double FOV;
         vec3 pos;
         Rotation rot;
-        SpectralImage image;
+        SpectralImage image;//allocated by the tracer, only the one matching the shading mode
+        XYZImage xyz_image;
 
         Camera(vec3 position, Rotation orientation, int xres=1024, int yres=1024, double fov=M_PI/2) {
             rot = orientation;
@@ -84,10 +89,9 @@ struct Camera {
             FOV=fov;
             resolution_v = xres;
             resolution_h = yres;
-            image = SpectralImage(yres, xres);
         }
 
-        Photon emit_photon(int img_x, int img_y, double speed_of_light=1);
+        Photon emit_photon(double img_x, double img_y, double speed_of_light=1);//pixel centres at whole coordinates
 };
 
 #include "3d.cpp"
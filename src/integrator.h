@@ -0,0 +1,76 @@
+#ifndef _INTEGRATOR_H
+#define _INTEGRATOR_H
+
+#include <cmath>
+
+//Dormand-Prince 5(4) with the usual 4th order error estimate and continuous extension (Hairer, Norsett, Wanner).
+//the state is a plain array of N doubles, f(t, y, dydt) evaluates the right-hand side.
+template<int N> struct DPStep {
+    double t, h;//step covers [t, t+h]
+    double y0[N], y1[N];
+    double k[7][N];//stage derivatives, k[6] is f(t+h, y1) and becomes k[0] of the next step
+    double err;//scaled error norm, accept if <= 1
+
+    //state at t + theta*h, theta in [0,1]
+    void dense(double theta, double* out) const {
+        static const double d1 = -12715105075.0/11282082432.0, d3 = 87487479700.0/32700410799.0,
+            d4 = -10690763975.0/1880347072.0, d5 = 701980252875.0/199316789632.0,
+            d6 = -1453857185.0/822651844.0, d7 = 69997945.0/29380423.0;
+        for(int i=0; i<N; ++i) {
+            double r2 = y1[i] - y0[i];
+            double r3 = h*k[0][i] - r2;
+            double r4 = r2 - h*k[6][i] - r3;
+            double r5 = h*(d1*k[0][i] + d3*k[2][i] + d4*k[3][i] + d5*k[4][i] + d6*k[5][i] + d7*k[6][i]);
+            out[i] = y0[i] + theta*(r2 + (1-theta)*(r3 + theta*(r4 + (1-theta)*r5)));
+        }
+    }
+};
+
+//one trial step from (t, y) with f(t, y) already in k0; error scaled by atol + rtol*|y|
+template<int N, typename F> void dp45_step(F &f, double t, const double* y, const double* k0, double h,
+        double atol, double rtol, DPStep<N> &s) {
+    static const double
+        a21 = 1.0/5,
+        a31 = 3.0/40, a32 = 9.0/40,
+        a41 = 44.0/45, a42 = -56.0/15, a43 = 32.0/9,
+        a51 = 19372.0/6561, a52 = -25360.0/2187, a53 = 64448.0/6561, a54 = -212.0/729,
+        a61 = 9017.0/3168, a62 = -355.0/33, a63 = 46732.0/5247, a64 = 49.0/176, a65 = -5103.0/18656,
+        b1 = 35.0/384, b3 = 500.0/1113, b4 = 125.0/192, b5 = -2187.0/6784, b6 = 11.0/84,
+        e1 = 71.0/57600, e3 = -71.0/16695, e4 = 71.0/1920, e5 = -17253.0/339200, e6 = 22.0/525, e7 = -1.0/40;
+    double tmp[N];
+    s.t = t;
+    s.h = h;
+    for(int i=0; i<N; ++i) {
+        s.y0[i] = y[i];
+        s.k[0][i] = k0[i];
+    }
+    for(int i=0; i<N; ++i) tmp[i] = y[i] + h*a21*s.k[0][i];
+    f(t + h/5, tmp, s.k[1]);
+    for(int i=0; i<N; ++i) tmp[i] = y[i] + h*(a31*s.k[0][i] + a32*s.k[1][i]);
+    f(t + 3*h/10, tmp, s.k[2]);
+    for(int i=0; i<N; ++i) tmp[i] = y[i] + h*(a41*s.k[0][i] + a42*s.k[1][i] + a43*s.k[2][i]);
+    f(t + 4*h/5, tmp, s.k[3]);
+    for(int i=0; i<N; ++i) tmp[i] = y[i] + h*(a51*s.k[0][i] + a52*s.k[1][i] + a53*s.k[2][i] + a54*s.k[3][i]);
+    f(t + 8*h/9, tmp, s.k[4]);
+    for(int i=0; i<N; ++i) tmp[i] = y[i] + h*(a61*s.k[0][i] + a62*s.k[1][i] + a63*s.k[2][i] + a64*s.k[3][i] + a65*s.k[4][i]);
+    f(t + h, tmp, s.k[5]);
+    for(int i=0; i<N; ++i) s.y1[i] = y[i] + h*(b1*s.k[0][i] + b3*s.k[2][i] + b4*s.k[3][i] + b5*s.k[4][i] + b6*s.k[5][i]);
+    f(t + h, s.y1, s.k[6]);
+    s.err = 0;
+    for(int i=0; i<N; ++i) {
+        double e = h*(e1*s.k[0][i] + e3*s.k[2][i] + e4*s.k[3][i] + e5*s.k[4][i] + e6*s.k[5][i] + e7*s.k[6][i]);
+        double sc = atol + rtol*fmax(fabs(y[i]), fabs(s.y1[i]));
+        double q = fabs(e)/sc;
+        s.err = q > s.err ? q : s.err;
+    }
+}
+
+//next step size after a trial step with scaled error err
+double dp45_next_h(double h, double err) {
+    double fac = err > 0 ? 0.9*pow(err, -0.2) : 5;
+    if(fac > 5) fac = 5;
+    if(fac < 0.2) fac = 0.2;
+    return h*fac;
+}
+
+#endif
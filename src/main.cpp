@@ -1,8 +1,16 @@
 #include "lib/glm/glm.hpp"
 #include "lib/pngpp/png.hpp"
 #include "3d.h"
+#include "integrator.h"
+#include "orbit.h"
+#include "packet.h"
 #include "spectral.h"
+#include "transfer.h"
+#include "workpool.h"
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <vector>
 #include <cstdio>
 
 using std::cerr;
@@ -27,84 +35,434 @@ struct BlackHole {
     }
 };
 
-Spectre getpx_bilinear (SpectralImage& texture, double x, double y){
-    unsigned xf = static_cast<unsigned>(floor(x)); 
-    unsigned yf = static_cast<unsigned>(floor(y)); 
-    unsigned xc = (xf+1)%(texture.get_height()-1);
-    unsigned yc = (yf+1)%(texture.get_width()-1);
-    double xr = x-xf;           
-    double yr = y-yf;           
-    Spectre px = texture.getpx(xc,yc)*(xr*yr);
-    px += texture.getpx(xc,yf)*(xr*(1-yr));
-    px += texture.getpx(xf,yc)*(yr*(1-xr));
-    px += texture.getpx(xf,yf)*((1-xr)*(1-yr));
+//the four texels a bilinear fetch at (x,y) blends, and the fractions. the far row and column are clamped to the
+//texture, except that columns wrap around the full width where wrap_columns is set (equirectangular panoramas)
+struct BilinearFootprint {
+    unsigned xf, yf, xc, yc;
+    double xr, yr;
+    BilinearFootprint(unsigned height, unsigned width, double x, double y, bool wrap_columns=false) {
+        xf = static_cast<unsigned>(floor(x)); 
+        yf = static_cast<unsigned>(floor(y)); 
+        xc = xf+1 < height ? xf+1 : height-1;
+        yc = yf+1 < width ? yf+1 : (wrap_columns ? 0 : width-1);
+        xr = x-xf;           
+        yr = y-yf;           
+    }
+};
+
+//px += weight * (bilinear sample at x,y), blending straight into px
+template<typename S> void add_bilinear (S &px, SpectralImageT<S>& texture, double x, double y, double weight, bool wrap_columns=false){
+    BilinearFootprint f(texture.get_height(), texture.get_width(), x, y, wrap_columns);
+    px.add_bilinear(texture.getpx(f.xc,f.yc), f.xr*f.yr, texture.getpx(f.xc,f.yf), f.xr*(1-f.yr),
+            texture.getpx(f.xf,f.yc), f.yr*(1-f.xr), texture.getpx(f.xf,f.yf), (1-f.xr)*(1-f.yr), weight);
+}
+
+//same from a quantized texture, dequantizing on the way
+template<typename S, typename Q> void add_bilinear (S &px, QuantizedTextureT<S,Q>& texture, double x, double y, double weight, bool wrap_columns=false){
+    BilinearFootprint f(texture.get_height(), texture.get_width(), x, y, wrap_columns);
+    texture.add_bilinear(px, f.xc, f.yc, f.xr*f.yr, f.xc, f.yf, f.xr*(1-f.yr),
+            f.xf, f.yc, f.yr*(1-f.xr), f.xf, f.yf, (1-f.xr)*(1-f.yr), weight);
+}
+
+template<typename S> S getpx_bilinear (SpectralImageT<S>& texture, double x, double y, bool wrap_columns=false){
+    S px;
+    add_bilinear(px, texture, x, y, 1.0, wrap_columns);
     return px;
 }
 
+template<typename S, typename Q> S getpx_bilinear (QuantizedTextureT<S,Q>& texture, double x, double y, bool wrap_columns=false){
+    S px;
+    add_bilinear(px, texture, x, y, 1.0, wrap_columns);
+    return px;
+}
 
 png::gray_pixel getpx_bilinear (png::image<png::gray_pixel>& texture, double x, double y){
-    unsigned xf = floor(x); 
-    unsigned yf = floor(y); 
-    unsigned xc = (xf+1)%(texture.get_height()-1);
-    unsigned yc = (yf+1)%(texture.get_width()-1);
-    double xr = x-xf;
-    double yr = y-yf;
-    png::gray_pixel px = texture[xc][yc]*xr*yr;
-    px += texture[xc][yf]*xr*(1-yr);
-    px += texture[xf][yc]*yr*(1-xr);
-    px += texture[xf][yf]*(1-xr)*(1-yr);
+    BilinearFootprint f(texture.get_height(), texture.get_width(), x, y);
+    png::gray_pixel px = texture[f.xc][f.yc]*f.xr*f.yr;
+    px += texture[f.xc][f.yf]*f.xr*(1-f.yr);
+    px += texture[f.xf][f.yc]*f.yr*(1-f.xr);
+    px += texture[f.xf][f.yf]*(1-f.xr)*(1-f.yr);
     return px;
 }
 
+//same without rounding each term down on the way, for fetches that get averaged
+double gray_bilinear (png::image<png::gray_pixel>& texture, double x, double y){
+    BilinearFootprint f(texture.get_height(), texture.get_width(), x, y);
+    return texture[f.xc][f.yc]*f.xr*f.yr + texture[f.xc][f.yf]*f.xr*(1-f.yr)
+        + texture[f.xf][f.yc]*f.yr*(1-f.xr) + texture[f.xf][f.yf]*(1-f.xr)*(1-f.yr);
+}
+
+//2x2 box filtered, rounded to the nearest level (an odd last row or column is taken twice)
+png::image<png::gray_pixel> downsampled (png::image<png::gray_pixel>& img) {
+    unsigned h = img.get_height(), w = img.get_width();
+    png::image<png::gray_pixel> half((w+1)/2, (h+1)/2);
+    for(unsigned x=0; x<half.get_height(); ++x) {
+        for(unsigned y=0; y<half.get_width(); ++y) {
+            unsigned xa = 2*x, xb = 2*x+1 < h ? 2*x+1 : 2*x;
+            unsigned ya = 2*y, yb = 2*y+1 < w ? 2*y+1 : 2*y;
+            half[x][y] = (img[xa][ya] + img[xa][yb] + img[xb][ya] + img[xb][yb] + 2)/4;
+        }
+    }
+    return half;
+}
+
+//the (at most two) levels a fetch at lod reads, and the weight of the first: trilinear with bilinear filtering,
+//the nearest level otherwise
+void pick_levels (int levels, enum filtering filter, double lod, int &l0, int &l1, double &w0) {
+    int top = levels-1;
+    w0 = 1;
+    if(lod <= 0 || !top) {
+        l0 = l1 = 0;
+    } else if(lod >= top) {
+        l0 = l1 = top;
+    } else if(filter == NEAREST_NEIGH) {
+        l0 = l1 = round(lod);
+    } else {
+        l0 = floor(lod);
+        l1 = l0+1;
+        w0 = 1 - (lod-l0);
+    }
+}
+
+//what a pre-shifted copy is kept as: XYZ texels in double (24 bytes), spectra quantized like the source textures, since
+//a shift only interpolates between bins and never leaves the source's range (190 bytes a texel instead of 760)
+template<typename Px> struct ShiftedImage {typedef SpectralImageT<Px> type;};
+template<> struct ShiftedImage<Spectre> {typedef QuantizedTextureT<Spectre, unsigned short> type;};
+
+//a spectral texture with the per-frame redshift already applied (and, for XYZ, already integrated)
+template<typename Px> struct ShiftedTexture {
+    typedef typename ShiftedImage<Px>::type image_type;
+    image_type image;
+    std::vector<image_type> mips;//the source's mip levels past the first, if it has any
+    double key;//what image was built for (star redshift factor, camera radius), NAN if nothing yet
+    ShiftedTexture() {key = NAN;}
+    size_t bytes () {
+        size_t b = image.bytes();
+        for(size_t l=0; l<mips.size(); ++l) b += mips[l].bytes();
+        return b;
+    }
+};
+
+//a pixel's footprint on the disk: the parallelogram spanned by a and b around the hit, both zero for a point
+struct DiskSpan {
+    vec3 a, b;
+    DiskSpan() : a(0,0,0), b(0,0,0) {}
+    bool point() const {return a.x == 0 && a.y == 0 && b.x == 0 && b.y == 0;}
+};
+
 struct AccretionDisk {
     double radius;
-    SpectralImage texture;
+    QuantizedTexture texture;
+    std::vector<QuantizedTexture> mips;//texture at 1/2, 1/4, ... of its resolution, empty if not mipmapped
     png::image<png::gray_pixel> alpha;
+    std::vector<png::image<png::gray_pixel> > alpha_mips;//same for alpha
     enum filtering filter;
-    Spectre get_pixel (vec3 point) {
-        double x = (texture.get_height()-1)*(point.x/(2*radius) + 0.5);
-        double y = (texture.get_width()-1)*(point.y/(2*radius) + 0.5);
+    int anisotropy;//most fetches along a footprint's long axis
+    ShiftedTexture<Spectre> shifted_spectral;
+    ShiftedTexture<XYZ> shifted_xyz;
+    ShiftedTexture<Spectre>& shifted(Spectre*) {return shifted_spectral;}
+    ShiftedTexture<XYZ>& shifted(XYZ*) {return shifted_xyz;}
+    template<typename Tex> typename Tex::texel_type sample (Tex &tex, vec3 point) {
+        double x, y;
+        texcoords(tex, point, x, y);
         if(filter==NEAREST_NEIGH) {
-            return texture.getpx(round(x),round(y));
-        } else if (filter==BILINEAR) {
-            return getpx_bilinear(texture, x, y);
+            return tex.getpx(round(x),round(y));
         }
+        return getpx_bilinear(tex, x, y);
     }
-    png::gray_pixel get_alpha (vec3 point) {
-        double x = (alpha.get_height()-1)*(point.x/(2*radius) + 0.5);
-        double y = (alpha.get_width()-1)*(point.y/(2*radius) + 0.5);
+    //px += sample of tex*weight, without the intermediate texel
+    template<typename Px, typename Tex> void add_sample (Px &px, Tex &tex, vec3 point, double weight) {
+        double x, y;
+        texcoords(tex, point, x, y);
         if(filter==NEAREST_NEIGH) {
-            return alpha[round(x)][round(y)];
+            px.add_scaled(tex.getpx(round(x),round(y)), weight);
         } else if (filter==BILINEAR) {
-            return getpx_bilinear(alpha, x, y);
+            add_bilinear(px, tex, x, y, weight);
+        }
+    }
+    //clamped to the texture, for fetches spread around a hit near the rim
+    template<typename Tex> void texcoords (Tex &tex, vec3 point, double &x, double &y) {
+        x = (tex.get_height()-1)*(point.x/(2*radius) + 0.5);
+        y = (tex.get_width()-1)*(point.y/(2*radius) + 0.5);
+        x = x > 0 ? (x < tex.get_height()-1 ? x : tex.get_height()-1) : 0;
+        y = y > 0 ? (y < tex.get_width()-1 ? y : tex.get_width()-1) : 0;
+    }
+    //Filtering a footprint on a texture of height x width texels (first level) with the given number of levels. The
+    //parallelogram's principal axes in texels are the singular values of [a b]; the long one is covered by up to
+    //anisotropy evenly spaced fetches, each at the level that makes them just overlap (or that of the short axis, if
+    //wider). calls tap(level, point, weight) for every fetch, the weights adding up to 1.
+    template<typename F> void footprint_taps (unsigned height, unsigned width, int levels, vec3 point, const DiskSpan &fp, F tap) {
+        double sx = (height-1)/(2*radius), sy = (width-1)/(2*radius);
+        double ax = fp.a.x*sx, ay = fp.a.y*sy, bx = fp.b.x*sx, by = fp.b.y*sy;
+        double m11 = ax*ax + bx*bx, m12 = ax*ay + bx*by, m22 = ay*ay + by*by;
+        double disc = sqrt((m11-m22)*(m11-m22) + 4*m12*m12);
+        double major = sqrt((m11 + m22 + disc)/2), minor = sqrt(fmax(m11 + m22 - disc, 0)/2);
+        int n = 1;
+        double lod = 0;
+        vec3 step(0,0,0);
+        if(major > 1) {
+            n = ceil(major/fmax(minor, 1));
+            n = n < anisotropy ? n : anisotropy;
+            lod = log2(fmax(major/n, minor));
+            //long axis: eigenvector of [a b][a b]^T for the larger eigenvalue
+            double ex = m12, ey = (m11 + m22 + disc)/2 - m11;
+            if(fabs(ex) + fabs(ey) < 1e-12*(m11 + m22)) {
+                ex = m11 >= m22;
+                ey = m11 < m22;
+            }
+            double len = sqrt(ex*ex + ey*ey);
+            step = vec3(ex/len*major/n/sx, ey/len*major/n/sy, 0);
+        }
+        int l0, l1;
+        double w0;
+        ::pick_levels(levels, filter, lod, l0, l1, w0);
+        for(int k=0; k<n; ++k) {
+            vec3 p = point + mul_vec(step, k - (n-1)/2.0);
+            tap(l0, p, w0/n);
+            if(l1 != l0) tap(l1, p, (1-w0)/n);
+        }
+    }
+    int levels () {return mips.size() + 1;}
+    QuantizedTexture& level (int l) {return l ? mips[l-1] : texture;}
+    template<typename Px> typename ShiftedTexture<Px>::image_type& shifted_level (int l) {
+        ShiftedTexture<Px> &c = shifted(static_cast<Px*>(NULL));
+        return l ? c.mips[l-1] : c.image;
+    }
+    png::image<png::gray_pixel>& alpha_level (int l) {return l ? alpha_mips[l-1] : alpha;}
+    size_t bytes () {
+        size_t b = 0;
+        for(int l=0; l<levels(); ++l) b += level(l).bytes();
+        for(size_t l=0; l<=alpha_mips.size(); ++l) b += alpha_level(l).get_height()*alpha_level(l).get_width();
+        return b;
+    }
+    TexSpectre get_pixel (vec3 point, const DiskSpan &fp=DiskSpan()) {
+        TexSpectre t;
+        footprint_taps(texture.get_height(), texture.get_width(), levels(), point, fp,
+            [&](int l, vec3 p, double w) {add_sample(t, level(l), p, w);});
+        return t;
+    }
+    //px += the pre-shifted copy's filtered fetch*weight; preshift_disk must have been run for this pixel type
+    template<typename Px> void add_shifted_pixel (Px &px, vec3 point, double weight, const DiskSpan &fp=DiskSpan()) {
+        footprint_taps(texture.get_height(), texture.get_width(), levels(), point, fp,
+            [&](int l, vec3 p, double w) {add_sample(px, shifted_level<Px>(l), p, weight*w);});
+    }
+    //distance from the centre to texel (x,y) of level l, inverse of the mapping in texcoords()
+    double texel_radius(int x, int y, int l=0) {
+        double px = (double(x)/(level(l).get_height()-1) - 0.5)*2*radius;
+        double py = (double(y)/(level(l).get_width()-1) - 0.5)*2*radius;
+        return sqrt(px*px + py*py);
+    }
+    //in [0,255]; a point (as without mipmaps) is fetched the way it always was, rounding down
+    double get_alpha (vec3 point, const DiskSpan &fp=DiskSpan()) {
+        if(fp.point()) {
+            double x, y;
+            texcoords(alpha, point, x, y);
+            if(filter==NEAREST_NEIGH) {
+                return alpha[round(x)][round(y)];
+            } else if (filter==BILINEAR) {
+                return getpx_bilinear(alpha, x, y);
+            }
+        }
+        double a = 0;
+        footprint_taps(alpha.get_height(), alpha.get_width(), alpha_mips.size()+1, point, fp,
+            [&](int l, vec3 p, double w) {
+                png::image<png::gray_pixel> &img = alpha_level(l);
+                double x, y;
+                texcoords(img, p, x, y);
+                a += w*(filter==NEAREST_NEIGH ? img[round(x)][round(y)] : gray_bilinear(img, x, y));
+            });
+        return a;
+    }
+    //box-filtered levels of the texture and of alpha, each down to about min_size texels across
+    void build_mips (enum texel_layout layout, unsigned min_size=8) {
+        mips.clear();
+        while(level(levels()-1).get_height() >= 2*min_size && level(levels()-1).get_width() >= 2*min_size) {
+            mips.push_back(level(levels()-1).downsampled(layout));
+        }
+        alpha_mips.clear();
+        for(png::image<png::gray_pixel>* top = &alpha; top->get_height() >= 2*min_size && top->get_width() >= 2*min_size;
+                top = &alpha_mips.back()) {
+            alpha_mips.push_back(downsampled(*top));
         }
     }
-    AccretionDisk(double r, SpectralImage tx, png::image<png::gray_pixel> alp, enum filtering fil=NEAREST_NEIGH){
+    AccretionDisk(double r, QuantizedTexture tx, png::image<png::gray_pixel> alp, enum filtering fil=NEAREST_NEIGH){
         radius = r;
-        texture = tx;
+        texture = std::move(tx);
         alpha = alp;
         filter=fil;
+        anisotropy = 16;
     }
 };
 
+//how a direction finds its place on the star panorama (rows by pitch, columns by yaw). equirect: through asin and atan2.
+//cube: through a cube map of panorama coordinates, six gnomonic faces, one per axis direction, stacked as blocks of
+//side+2 rows of side+2 entries; the extra border entries come from the directions just past the face's edges, so a
+//bilinear fetch never has to leave its face. the coordinates are smooth, so interpolating them lands within a few
+//thousandths of a texel of the exact spot, except near the poles, where the cube defers to equirect.
+enum star_projection {STARS_EQUIRECT, STARS_CUBE};
+const double cube_pole_z = 0.9;
+
 struct StarField {
-    SpectralImage texture;
+    QuantizedTexture texture;
+    std::vector<QuantizedTexture> mips;//texture at 1/2, 1/4, ... of its resolution, empty if not mipmapped
     enum filtering filter;
-    Spectre get_pixel (vec3 velocity) {
-        double ptc = asin(velocity.z)/PI;
-        double yaw = atan2(velocity.x, velocity.y)/(2*PI);
-        double x = (texture.get_height()-1)*(0.5-ptc);
-        double y = (texture.get_width()-1)*(0.5+yaw) ;
-        while (y>=texture.get_width()) {y-=texture.get_width();}
+    enum star_projection projection;
+    unsigned cube_side;
+    std::vector<float> cube_coords;//(row, column) per cube entry, as fractions of the panorama's height-1 and width
+    ShiftedTexture<Spectre> shifted_spectral;
+    ShiftedTexture<XYZ> shifted_xyz;
+    ShiftedTexture<Spectre>& shifted(Spectre*) {return shifted_spectral;}
+    ShiftedTexture<XYZ>& shifted(XYZ*) {return shifted_xyz;}
+    //cube face of a direction (0..5 for +x,-x,+y,-y,+z,-z) and where on it the direction lands, s and t in [-1,1]
+    static int cube_face (vec3 d, double &s, double &t) {
+        double ax = fabs(d.x), ay = fabs(d.y), az = fabs(d.z);
+        if(ax >= ay && ax >= az) {
+            s = d.y/ax;
+            t = d.z/ax;
+            return d.x > 0 ? 0 : 1;
+        } else if(ay >= az) {
+            s = d.x/ay;
+            t = d.z/ay;
+            return d.y > 0 ? 2 : 3;
+        }
+        s = d.x/az;
+        t = d.y/az;
+        return d.z > 0 ? 4 : 5;
+    }
+    //inverse of cube_face, not normalized
+    static vec3 cube_direction (int face, double s, double t) {
+        double a = face%2 ? -1 : 1;
+        switch(face/2) {
+            case 0: return vec3(a, s, t);
+            case 1: return vec3(s, a, t);
+            default: return vec3(s, t, a);
+        }
+    }
+    //where velocity lands on the panorama, u in [0,1] from pole to pole and v in [0,1) round the yaw
+    static void equirect_coords (vec3 velocity, double &u, double &v) {
+        u = 0.5 - asin(velocity.z)/PI;
+        v = 0.5 + atan2(velocity.x, velocity.y)/(2*PI);
+    }
+    //same from the cube map, blending the four nearest entries; v is unwrapped across the seam first
+    void cube_coords_at (vec3 velocity, double &u, double &v) {
+        double s, t;
+        int face = cube_face(velocity, s, t);
+        BilinearFootprint f(cube_side+2, cube_side+2, 0.5 + (s+1)*0.5*cube_side, 0.5 + (t+1)*0.5*cube_side);
+        const float* e = &cube_coords[face*(cube_side+2)*(cube_side+2)*2];
+        const float* a = e + (f.xf*(cube_side+2) + f.yf)*2;
+        const float* b = e + (f.xf*(cube_side+2) + f.yc)*2;
+        const float* c = e + (f.xc*(cube_side+2) + f.yf)*2;
+        const float* d = e + (f.xc*(cube_side+2) + f.yc)*2;
+        double vb = b[1] - round(b[1]-a[1]), vc = c[1] - round(c[1]-a[1]), vd = d[1] - round(d[1]-a[1]);
+        u = (a[0]*(1-f.yr) + b[0]*f.yr)*(1-f.xr) + (c[0]*(1-f.yr) + d[0]*f.yr)*f.xr;
+        v = (a[1]*(1-f.yr) + vb*f.yr)*(1-f.xr) + (vc*(1-f.yr) + vd*f.yr)*f.xr;
+    }
+    template<typename Tex> void texcoords (Tex &tex, vec3 velocity, double &x, double &y) {
+        double u, v;
+        if(projection == STARS_CUBE && fabs(velocity.z) < cube_pole_z) {
+            cube_coords_at(velocity, u, v);
+        } else {
+            equirect_coords(velocity, u, v);
+        }
+        //first and last rows are the poles; the yaw goes round all width columns, the last one being next to the first
+        x = (tex.get_height()-1)*u;
+        y = tex.get_width()*(v - floor(v));
+        if(y >= tex.get_width()) y -= tex.get_width();
+    }
+    template<typename Tex> typename Tex::texel_type sample (Tex &tex, vec3 velocity) {
+        double x, y;
+        texcoords(tex, velocity, x, y);
         if(filter==NEAREST_NEIGH) {
             int xx=static_cast<int>(round(x));
-            int yy=static_cast<int>(round(y));
-            return texture.getpx(xx,yy);
+            int yy=static_cast<int>(round(y))%tex.get_width();
+            return tex.getpx(xx,yy);
+        }
+        return getpx_bilinear(tex, x, y, true);
+    }
+    int levels () {return mips.size() + 1;}
+    size_t bytes () {
+        size_t b = 0;
+        for(int l=0; l<levels(); ++l) b += level(l).bytes();
+        return b + cube_coords.size()*sizeof(float);
+    }
+    QuantizedTexture& level (int l) {return l ? mips[l-1] : texture;}
+    template<typename Px> typename ShiftedTexture<Px>::image_type& shifted_level (int l) {
+        ShiftedTexture<Px> &c = shifted(static_cast<Px*>(NULL));
+        return l ? c.mips[l-1] : c.image;
+    }
+    //texels per radian of sky on the first level (along the meridians)
+    double texel_density () {
+        return (texture.get_height()-1)/PI;
+    }
+    //level of detail for a ray whose cone is width radians wide on the sky
+    double lod (double width) {
+        double l = log2(width*texel_density());
+        return l > 0 ? l : 0;
+    }
+    void pick_levels (double lod, int &l0, int &l1, double &w0) {
+        ::pick_levels(levels(), filter, lod, l0, l1, w0);
+    }
+    TexSpectre get_pixel (vec3 velocity, double lod=0) {
+        int l0, l1;
+        double w0;
+        pick_levels(lod, l0, l1, w0);
+        TexSpectre t = sample(level(l0), velocity);
+        if(l1 != l0) {
+            t *= w0;
+            t.add_scaled(sample(level(l1), velocity), 1-w0);
+        }
+        return t;
+    }
+    //px += sample of tex*weight, without the intermediate texel
+    template<typename Px, typename Tex> void add_sample (Px &px, Tex &tex, vec3 velocity, double weight) {
+        double x, y;
+        texcoords(tex, velocity, x, y);
+        if(filter==NEAREST_NEIGH) {
+            px.add_scaled(tex.getpx(static_cast<int>(round(x)),static_cast<int>(round(y))%tex.get_width()), weight);
         } else if (filter==BILINEAR) {
-            return getpx_bilinear(texture, x, y);
+            add_bilinear(px, tex, x, y, weight, true);
+        }
+    }
+    //from the pre-shifted copy; preshift_stars must have been run for this pixel type
+    template<typename Px> void add_shifted_pixel (Px &px, vec3 velocity, double weight, double lod=0) {
+        int l0, l1;
+        double w0;
+        pick_levels(lod, l0, l1, w0);
+        add_sample(px, shifted_level<Px>(l0), velocity, weight*w0);
+        if(l1 != l0) {
+            add_sample(px, shifted_level<Px>(l1), velocity, weight*(1-w0));
+        }
+    }
+    //box-filtered levels down to about min_size texels across
+    void build_mips (enum texel_layout layout, unsigned min_size=8) {
+        mips.clear();
+        while(level(levels()-1).get_height() >= 2*min_size) {
+            mips.push_back(level(levels()-1).downsampled(layout));
         }
     }
-    StarField(SpectralImage t, enum filtering fil=NEAREST_NEIGH) {texture = t; filter=fil;}
+    //tabulate the cube map of panorama coordinates, at twice the panorama's texel density at the face centres
+    //(side = 2*width/pi): interpolated coordinates then stay within 0.005 texels of the exact ones for |z| < cube_pole_z
+    void build_cube (unsigned threads) {
+        cube_side = round(2*texture.get_width()/PI);
+        unsigned n = cube_side+2;
+        cube_coords.assign(6*n*n*2, 0);
+        run_tiled(6*n, n, 64, threads,
+            [&](const Tile &tl, unsigned) {
+                for(int x=tl.x0; x<tl.x1; ++x) {
+                    int face = x/n;
+                    int r = x%n;
+                    for(int y=tl.y0; y<tl.y1; ++y) {
+                        double u, v;
+                        equirect_coords(normalize(cube_direction(face, (r-0.5)*2/cube_side - 1, (y-0.5)*2/cube_side - 1)), u, v);
+                        cube_coords[(size_t(x)*n + y)*2] = u;
+                        cube_coords[(size_t(x)*n + y)*2 + 1] = v;
+                    }
+                }
+            }
+        );
+        projection = STARS_CUBE;
+    }
+    StarField(QuantizedTexture t, enum filtering fil=NEAREST_NEIGH) {texture = std::move(t); filter=fil; projection=STARS_EQUIRECT; cube_side=0;}
 };
 
 struct Scene {
@@ -112,84 +470,1048 @@ struct Scene {
     BlackHole* hole;
     AccretionDisk* disk;
     StarField* stars;
-    Scene(Camera* c, BlackHole* h, AccretionDisk* d, StarField* f){
+    ShiftResponse* response;//only needed for fused shading
+    SkyFootprint* sky;//per frame, only needed with mipmapped stars
+    DiskFootprint* disk_footprint;//per frame, only needed with a mipmapped disk
+    RayTable* rays;//per frame, only needed for INTEGRATE_TABLE
+    TransferTable* transfer;//only needed for INTEGRATE_TRANSFER
+    TransferStarts* transfer_starts;//per frame, the camera's place on the transfer table's orbits
+    const IntTable* cie;//only needed for adaptive sampling, which compares pixels as they will be saved
+    double rgb_norm;
+    Scene(Camera* c, BlackHole* h, AccretionDisk* d, StarField* f, ShiftResponse* r=NULL){
         cam = c;
         hole = h;
         disk = d;
         stars = f;
+        response = r;
+        sky = NULL;
+        disk_footprint = NULL;
+        rays = NULL;
+        transfer = NULL;
+        transfer_starts = NULL;
+        cie = NULL;
+        rgb_norm = 1;
     }
 };
 
+//add a texel, seen with the given redshift factor, to a pixel (the scene only matters to the XYZ version)
+void shade(Spectre &px, Scene &, const TexSpectre &texel, double redfact, double weight) {
+    px.add_shifted(texel, redfact, weight);
+}
+
+void shade(XYZ &px, Scene &scene, const TexSpectre &texel, double redfact, double weight) {
+    px.add_scaled(scene.response->response(texel, redfact), weight);
+}
+
+//blank pre-shifted copy of src, same size and layout
+void blank_shifted(SpectralImageT<XYZ> &dst, QuantizedTexture &src) {
+    dst = SpectralImageT<XYZ>(src.get_width(), src.get_height(), src.get_layout());
+}
+
+void blank_shifted(ShiftedImage<Spectre>::type &dst, QuantizedTexture &src) {
+    typedef ShiftedImage<Spectre>::type Dst;
+    const double range = src.get_scale()*std::numeric_limits<unsigned char>::max();//no shifted value exceeds the source's
+    dst = Dst(src.get_height(), src.get_width(), range/std::numeric_limits<unsigned short>::max(), src.get_layout());
+}
+
+void set_shifted(SpectralImageT<XYZ> &dst, int x, int y, const XYZ &px) {dst.getpx(x,y) = px;}
+void set_shifted(ShiftedImage<Spectre>::type &dst, int x, int y, const Spectre &px) {dst.set_texel(x, y, px);}
+
+//shift every texel of src by factor(x,y) into dst
+template<typename Px, typename F> void shift_texels(Scene &scene, QuantizedTexture &src, typename ShiftedImage<Px>::type &dst, unsigned threads, F factor) {
+    blank_shifted(dst, src);
+    run_tiled(src.get_height(), src.get_width(), 64, threads,
+        [&](const Tile &t, unsigned) {
+            for (int x=t.x0; x<t.x1; x++){
+                for (int y=t.y0; y<t.y1; y++){
+                    Px px;
+                    shade(px, scene, src.getpx(x,y), factor(x,y), 1);
+                    set_shifted(dst, x, y, px);
+                }
+            }
+        }
+    );
+}
+
+//shift src and its mip levels (if src_mips is given) into cache, unless it was already built for key.
+//factor(level, x, y) as in shift_texels, level 0 being src itself
+template<typename Px, typename F> void preshift_texture(Scene &scene, QuantizedTexture &src, std::vector<QuantizedTexture>* src_mips,
+        ShiftedTexture<Px> &cache, double key, unsigned threads, F factor) {
+    if(cache.key == key) return;
+    shift_texels<Px>(scene, src, cache.image, threads, [&](int x, int y) {return factor(0, x, y);});
+    cache.mips.resize(src_mips ? src_mips->size() : 0);
+    for(size_t l=0; l<cache.mips.size(); ++l) {
+        shift_texels<Px>(scene, (*src_mips)[l], cache.mips[l], threads, [&](int x, int y) {return factor(l+1, x, y);});
+    }
+    cache.key = key;
+}
+
+//every escaping ray sees the stars with the same redshift factor, so shift the whole texture once per frame;
+//the result is kept and reused as long as the factor (i.e. the camera radius) stays the same
+template<typename Px> void preshift_stars(Scene &scene, double redfact, unsigned threads) {
+    cerr<<"Shifting star texture...";
+    ShiftedTexture<Px> &cache = scene.stars->shifted(static_cast<Px*>(NULL));
+    preshift_texture(scene, scene.stars->texture, &scene.stars->mips, cache, redfact, threads,
+        [&](int, int, int) {return redfact;});
+    cerr<<"Done, "<<cache.bytes()/1048576<<" MB."<<endl;
+}
+
 double redshift_factor(double sch_rad, double src_rad, double dest_rad) {return sqrt((1/sch_rad - 1/dest_rad) / (1/sch_rad - 1/src_rad));}
+
+//a disk hit's redshift factor only depends on the radius it lands on, so shift each disk texel once per frame
+//for its own radius; a hit is then a filtered fetch like any other. kept while the camera radius is the same.
+template<typename Px> void preshift_disk(Scene &scene, bool enable_redshift, unsigned threads) {
+    AccretionDisk &disk = *scene.disk;
+    double cam_rad = abs(scene.cam->pos);
+    cerr<<"Shifting disk texture...";
+    ShiftedTexture<Px> &cache = disk.shifted(static_cast<Px*>(NULL));
+    preshift_texture(scene, disk.texture, &disk.mips, cache, enable_redshift ? cam_rad : 0, threads,
+        [&](int l, int x, int y) {
+            if(!enable_redshift) return 1.0;
+            double r = disk.texel_radius(x, y, l);
+            return r > scene.hole->radius ? redshift_factor(scene.hole->radius, r, cam_rad) : INFINITY;//nothing lands inside the hole
+        });
+    cerr<<"Done, "<<cache.bytes()/1048576<<" MB."<<endl;
+}
+
 template<typename T> T min(T x, T y) {if(x<y){ return x; }else{ return y;}}
-void trace_photons(Scene &scene, double min_tick=1.0, double dyn_tick_power=0, double dyn_tick_max_factor = 5, unsigned maxsteps = 1000, bool enable_redshift=true){
-    unsigned ctr,total_steps=0;
+
+enum integration {INTEGRATE_STEPPER, INTEGRATE_BINET, INTEGRATE_DOPRI, INTEGRATE_TABLE, INTEGRATE_TRANSFER};
+
+struct TracerSettings {
+    double min_tick;
+    double dyn_tick_power;
+    double dyn_tick_max_factor;
+    unsigned maxsteps;
+    bool enable_redshift;
+    bool fused_shading;
+    bool preshift_stars;
+    bool preshift_disk;
+    int shift_levels;
+    bool capture_test;
+    double capture_margin;
+    double winding_radius;//r_s, inbound stepper rays that turn within it are carried past the turning point analytically; 0: off
+    double weak_field_tol;//pixels, 0 to integrate all the way
+    double weak_field_tol_rad;//same in radians, set up per camera
+    double bypass_tol;//pixels, 0 to never skip a whole ray
+    double bypass_tol_rad;
+    enum integration integrator;
+    double binet_tol;//local error per step of w and dw/dphi
+    double dopri_tol;//local error per step of position (in r_s) and velocity
+    int ray_table_rows;//angles in the per-frame ray table of INTEGRATE_TABLE
+    double transfer_tol;//pixels, estimated error INTEGRATE_TRANSFER may leave in a ray before it is integrated instead
+    double transfer_tol_rad;
+    enum packet_isa packets;//instruction set for stepper packets, PACKET_OFF for one ray at a time
+    enum texel_layout texture_layout;//storage order of the disk and star textures and their pre-shifted copies
+    enum star_projection star_projection;//STARS_CUBE to look the star panorama up through a cube map built at load time
+    bool star_mipmaps;//filter the stars by each ray's footprint on the sky
+    bool disk_mipmaps;//filter the disk and its alpha by each ray's footprint on it
+    int disk_anisotropy;//most fetches along the long axis of a footprint on the disk
+    unsigned threads;
+    int tile_size;
+    int max_spp;//rays per pixel adaptive sampling may go up to, 1 for one through each centre
+    double aa_threshold;//8-bit levels of the output: contrast to a neighbour that gets a pixel more rays
+    TracerSettings() {
+        min_tick = 1.0;
+        dyn_tick_power = 0;
+        dyn_tick_max_factor = 5;
+        maxsteps = 1000;
+        enable_redshift = true;
+        fused_shading = false;
+        preshift_stars = true;
+        preshift_disk = false;
+        shift_levels = 4096;
+        capture_test = true;
+        capture_margin = 0.05;
+        winding_radius = 0;
+        weak_field_tol = 0;
+        weak_field_tol_rad = 0;
+        bypass_tol = 0;
+        bypass_tol_rad = 0;
+        integrator = INTEGRATE_STEPPER;
+        binet_tol = 1e-9;
+        dopri_tol = 1e-7;
+        ray_table_rows = 4096;
+        transfer_tol = 0.05;
+        transfer_tol_rad = 0;
+        packets = PACKET_AUTO;
+        texture_layout = LAYOUT_MORTON;
+        star_projection = STARS_EQUIRECT;
+        star_mipmaps = false;
+        disk_mipmaps = false;
+        disk_anisotropy = 16;
+        threads = 1;
+        tile_size = 16;
+        max_spp = 1;
+        aa_threshold = 4;
+    }
+};
+
+//dyn_tick_power if it is a small whole number, -1 otherwise
+int stepper_tick_pow(const TracerSettings &ts) {
+    double n = ts.dyn_tick_power;
+    return (n >= 0 && n <= 16 && n == floor(n)) ? (int)n : -1;
+}
+
+//per-thread counters, summed up once the frame is done
+struct TraceStats {
+    unsigned long long steps;
+    unsigned long long captured;//rays cut short by the capture test
+    unsigned long long bypassed;//rays that never needed integrating
+    unsigned long long tabled;//rays shaded from the ray table or the transfer table
+    unsigned long long wound;//stepper rays carried past their turning point
+    unsigned long long refined;//pixels adaptive sampling gave more rays
+    unsigned long long extra_rays;//and how many
+    double skipped_steps;//estimate of what integrating them to the horizon would have cost
+    static const int hist_bins = 128;//steps per stepper ray, in quarter octaves
+    unsigned long long hist[hist_bins];
+    unsigned max_steps;
+    TraceStats() {
+        steps = 0;
+        captured = 0;
+        bypassed = 0;
+        tabled = 0;
+        wound = 0;
+        refined = 0;
+        extra_rays = 0;
+        skipped_steps = 0;
+        for(int i=0; i<hist_bins; ++i) hist[i] = 0;
+        max_steps = 0;
+    }
+    TraceStats& operator+=(const TraceStats& o) {
+        steps += o.steps;
+        captured += o.captured;
+        bypassed += o.bypassed;
+        tabled += o.tabled;
+        wound += o.wound;
+        refined += o.refined;
+        extra_rays += o.extra_rays;
+        skipped_steps += o.skipped_steps;
+        for(int i=0; i<hist_bins; ++i) hist[i] += o.hist[i];
+        max_steps = o.max_steps > max_steps ? o.max_steps : max_steps;
+        return *this;
+    }
+    //a stepper ray is done after n steps
+    void add_ray(unsigned n) {
+        steps += n;
+        int bin = int(4*log2(n+1.0));
+        ++hist[bin < hist_bins ? bin : hist_bins-1];
+        max_steps = n > max_steps ? n : max_steps;
+    }
+    //fewest steps that at least frac of the stepper rays stay within (the top of its bin)
+    unsigned percentile(double frac) const {
+        unsigned long long total = 0, sum = 0;
+        for(int i=0; i<hist_bins; ++i) total += hist[i];
+        for(int i=0; i<hist_bins; ++i) {
+            sum += hist[i];
+            if(sum >= frac*total) return min((unsigned)ceil(exp2((i+1)/4.0)) - 1, max_steps);
+        }
+        return max_steps;
+    }
+};
+
+//true if a captured ray at pos may still cross the disk plane outside the horizon; counts the skip otherwise
+bool disk_crossing_ahead(Scene &scene, const TracerSettings &ts, const OrbitalPlane &orbit, vec3 pos, TraceStats &stats) {
+    double sweep, steps;
+    captured_descent(abs(pos), orbit.C, scene.hole->GM, scene.hole->radius,
+            ts.min_tick, ts.dyn_tick_power, ts.dyn_tick_max_factor, sweep, steps);
+    if(angle_to_next_node(orbit, pos) < sweep*(1+ts.capture_margin) + ts.capture_margin) return true;
+    ++stats.captured;
+    stats.skipped_steps += steps;
+    return false;
+}
+
+//level of detail of the stars seen along dir by a ray that left the camera on orbit
+double star_lod(Scene &scene, const OrbitalPlane &orbit, vec3 dir) {
+    return scene.sky ? scene.stars->lod(scene.sky->width(orbit, dir)) : 0;
+}
+
+template<typename Px> void shade_stars(Px &px, Scene &scene, const TracerSettings &ts, vec3 dir, double lod, double weight) {
+    if(ts.preshift_stars) {
+        scene.stars->add_shifted_pixel(px, dir, weight, lod);
+    } else {
+        double redfact = ts.enable_redshift ? redshift_factor(scene.hole->radius, INFINITY, abs(scene.cam->pos)) : 1;
+        shade(px, scene, scene.stars->get_pixel(dir, lod), redfact, weight);
+    }
+}
+
+//footprint on the disk of the pixel whose ray left the camera on orbit and crosses at isect heading along dir
+DiskSpan disk_span(Scene &scene, const OrbitalPlane &orbit, vec3 isect, vec3 dir) {
+    DiskSpan fp;
+    if(scene.disk_footprint) scene.disk_footprint->axes(orbit, isect, dir, fp.a, fp.b);
+    return fp;
+}
+
+template<typename Px> void shade_disk(Px &px, Scene &scene, const TracerSettings &ts, vec3 isect, const DiskSpan &fp, double &alpha_left) {
+    double used_alpha = scene.disk->get_alpha(isect, fp)*alpha_left/255;
+    if(ts.preshift_disk) {
+        scene.disk->add_shifted_pixel(px, isect, used_alpha, fp);
+    } else {
+        double redfact = ts.enable_redshift ? redshift_factor(scene.hole->radius, abs(isect), abs(scene.cam->pos)) : 1;
+        shade(px, scene, scene.disk->get_pixel(isect, fp), redfact, used_alpha);
+    }
+    alpha_left -= used_alpha;
+}
+
+//theta in [0,1] where component i of the step's interpolant crosses level, given that it does (bisection)
+template<int N> double dense_root(const DPStep<N> &s, int i, double level, bool rising) {
+    double lo = 0, hi = 1, yd[N];
+    for(int k=0; k<48; ++k) {
+        double mid = (lo+hi)/2;
+        s.dense(mid, yd);
+        if((yd[i] < level) == rising) lo = mid; else hi = mid;
+    }
+    return hi;
+}
+
+//shade a ray whose orbit a table has, given its next node and the angle phi_end where it escapes or falls in:
+//the disk at every node it crosses, then the stars if it escapes. radius_at(phi, w, dw) looks w = r_s/r and
+//dw/dphi up, false where the table cannot vouch for them. false, with nothing shaded, if any lookup fails.
+template<typename Px, typename RadiusAt> bool shade_tabulated(Px &px, Scene &scene, const TracerSettings &ts, const OrbitalPlane &orbit,
+        double node, double phi_end, enum ray_fate fate, RadiusAt radius_at, double &alpha_left) {
+    const double rs = scene.hole->radius;
+    //look every crossing up before shading any, so that a refusal leaves the ray untouched
+    const int max_hits = 4;
+    double hit_phi[max_hits], hit_w[max_hits], hit_dw[max_hits];
+    int hits = 0;
+    for(double phi = node; phi < phi_end; phi += M_PI) {
+        double w, dw;
+        if(hits == max_hits || !radius_at(phi, w, dw)) return false;
+        if(w > rs/scene.disk->radius && w < 1) {
+            hit_phi[hits] = phi;
+            hit_w[hits] = w;
+            hit_dw[hits] = dw;
+            ++hits;
+        }
+    }
+    for(int k=0; k<hits; ++k) {
+        vec3 radial = mul_vec(orbit.e1, cos(hit_phi[k])) + mul_vec(orbit.e2, sin(hit_phi[k]));
+        vec3 isect = mul_vec(radial, rs/hit_w[k]);
+        isect.z = 0;
+        vec3 dir = normalize(mul_vec(radial, -hit_dw[k]/hit_w[k]) + crossprod(orbit.n, radial));
+        shade_disk(px, scene, ts, isect, disk_span(scene, orbit, isect, dir), alpha_left);
+    }
+    if(fate == ESCAPING) {
+        vec3 dir = mul_vec(orbit.e1, cos(phi_end)) + mul_vec(orbit.e2, sin(phi_end));
+        shade_stars(px, scene, ts, dir, star_lod(scene, orbit, dir), alpha_left);
+    }
+    return true;
+}
+
+//shade the ray from the frame's RayTable, p being where it leaves the camera. false, with nothing shaded,
+//for the rays the table cannot vouch for.
+template<typename Px> bool trace_table(Px &px, Scene &scene, const TracerSettings &ts, const Photon &p, const OrbitalPlane &orbit,
+        double &alpha_left) {
+    const RayTable &table = *scene.rays;
+    double psi0 = RayTable::angle_of(p.pos, p.vel);
+    double node = angle_to_next_node(orbit, p.pos);
+    double phi_end;
+    if(node == INFINITY) return false;
+    enum ray_fate fate = table.fate_of(psi0, phi_end);
+    if(fate == NEAR_CRITICAL) return false;
+    return shade_tabulated(px, scene, ts, orbit, node, phi_end, fate, [&](double phi, double &w, double &dw) {
+        return table.radius_at(psi0, phi, w, dw);
+    }, alpha_left);
+}
+
+//shade the ray from the transfer table, p being where it leaves the camera, like trace_table does from the frame's own.
+//false, with nothing shaded, where the table's error estimate misses transfer_tol.
+template<typename Px> bool trace_transfer(Px &px, Scene &scene, const TracerSettings &ts, const Photon &p, const OrbitalPlane &orbit,
+        double &alpha_left) {
+    const TransferTable &table = *scene.transfer;
+    double node = angle_to_next_node(orbit, p.pos);
+    if(node == INFINITY || orbit.C <= 0) return false;
+    TransferRay ray;
+    if(!table.start(*scene.transfer_starts, scene.hole->radius/orbit.C, orbit.inbound, ts.transfer_tol_rad, ray)) return false;
+    return shade_tabulated(px, scene, ts, orbit, node, ray.end, ray.fate, [&](double phi, double &w, double &dw) {
+        return table.radius_at(ray, phi, ts.transfer_tol_rad, w, dw);
+    }, alpha_left);
+}
+
+//integrate the ray as w(phi) in its orbital plane (see BinetOrbit). disk crossings come from the line of nodes,
+//so every step is cut to land on the next one; escaping rays are followed to w = 0 for their exact direction.
+//false if the ray is not fit for it (radial, or lying in the disk plane) and has to go to the stepper.
+template<typename Px> bool trace_binet(Px &px, Scene &scene, const TracerSettings &ts, Photon &p, const OrbitalPlane &cam_orbit,
+        double &alpha_left, TraceStats &stats) {
+    const double rs = scene.hole->radius;
+    OrbitalPlane orbit(p.pos, p.vel, scene.hole->GM);
+    BinetOrbit f;
+    double y[2], k0[2];
+    if(!binet_start(orbit, p.pos, p.vel, scene.hole->GM, rs, f, y)) return false;
+    double node = angle_to_next_node(orbit, p.pos);
+    if(node == INFINITY) return false;
+    const double w_disk = rs/scene.disk->radius;
+    const double h_max = M_PI/8;
+    DPStep<2> s;
+    double phi = 0, h = 0.05;
+    unsigned ctr;
+    f(phi, y, k0);
+    for(ctr = 0; ctr < ts.maxsteps; ++ctr) {
+        bool at_node = false;
+        if(h > h_max) h = h_max;
+        if(phi + h >= node) {
+            h = node - phi;
+            at_node = true;
+        }
+        dp45_step(f, phi, y, k0, h, ts.binet_tol, ts.binet_tol, s);
+        if(s.err > 1) {
+            h = dp45_next_h(h, s.err);
+            continue;
+        }
+        if(s.y1[0] <= 0) {//reached infinity within the step: find where, the polar angle there is the direction
+            double phi_inf = phi + dense_root(s, 0, 0, false)*h;
+            vec3 dir = mul_vec(orbit.e1, cos(phi_inf)) + mul_vec(orbit.e2, sin(phi_inf));
+            shade_stars(px, scene, ts, dir, star_lod(scene, cam_orbit, dir), alpha_left);
+            break;
+        }
+        if(s.y1[0] >= 1) break;//into the hole
+        phi = at_node ? node : phi + h;
+        h = dp45_next_h(h, s.err);
+        y[0] = s.y1[0];
+        y[1] = s.y1[1];
+        k0[0] = s.k[6][0];
+        k0[1] = s.k[6][1];
+        if(at_node) {
+            node += M_PI;
+            if(y[0] > w_disk) {
+                vec3 isect = mul_vec(orbit.e1, rs*cos(phi)/y[0]) + mul_vec(orbit.e2, rs*sin(phi)/y[0]);
+                isect.z = 0;
+                //direction from w' = dw/dphi: dr/dphi = -r^2*w'/r_s along the radius, r along the motion
+                vec3 radial = div_vec(isect, abs(isect)), along = crossprod(orbit.n, radial);
+                vec3 dir = normalize(mul_vec(radial, -y[1]/y[0]) + along);
+                shade_disk(px, scene, ts, isect, disk_span(scene, cam_orbit, isect, dir), alpha_left);
+            }
+        }
+    }
+    stats.steps += ctr;
+    return true;
+}
+
+//integrate the tracer's equations in 3D with an error-controlled Dormand-Prince step. disk crossings and hole
+//entry are located on the step's interpolant instead of by shrinking the step.
+template<typename Px> void trace_dopri(Px &px, Scene &scene, const TracerSettings &ts, Photon &p, const OrbitalPlane &cam_orbit,
+        double &alpha_left, TraceStats &stats) {
+    const double rs = scene.hole->radius;
+    const double disk_rad = scene.disk->radius/rs;
+    const bool weak_field = ts.weak_field_tol_rad > 0;
+    TracerField f;
+    double y[6], k0[6];
+    y[0] = p.pos.x/rs; y[1] = p.pos.y/rs; y[2] = p.pos.z/rs;
+    y[3] = p.vel.x; y[4] = p.vel.y; y[5] = p.vel.z;
+    DPStep<6> s;
+    double t = 0, h = 0.1;
+    unsigned ctr;
+    f(t, y, k0);
+    for(ctr = 0; ctr < ts.maxsteps; ++ctr) {
+        double rad = sqrt(y[0]*y[0] + y[1]*y[1] + y[2]*y[2]);
+        if(h > rad/2) h = rad/2;
+        dp45_step(f, t, y, k0, h, ts.dopri_tol, ts.dopri_tol, s);
+        if(s.err > 1) {
+            h = dp45_next_h(h, s.err);
+            continue;
+        }
+        double yd[6];
+        double new_rad = sqrt(s.y1[0]*s.y1[0] + s.y1[1]*s.y1[1] + s.y1[2]*s.y1[2]);
+        double theta_hole = 2;//where the step enters the hole, past its end if it does not
+        if(new_rad < 1) {
+            double lo = 0, hi = 1;
+            for(int k=0; k<48; ++k) {
+                double mid = (lo+hi)/2;
+                s.dense(mid, yd);
+                if(yd[0]*yd[0] + yd[1]*yd[1] + yd[2]*yd[2] > 1) lo = mid; else hi = mid;
+            }
+            theta_hole = hi;
+        }
+        if(s.y0[2]*s.y1[2] <= 0 && s.y0[2] != s.y1[2]) {//crosses the disk plane
+            double theta = dense_root(s, 2, 0, s.y1[2] > s.y0[2]);
+            s.dense(theta, yd);
+            double isec_rad = sqrt(yd[0]*yd[0] + yd[1]*yd[1]);
+            if(theta < theta_hole && isec_rad >= 1 && isec_rad < disk_rad) {
+                vec3 isect(yd[0]*rs, yd[1]*rs, 0);
+                shade_disk(px, scene, ts, isect, disk_span(scene, cam_orbit, isect, vec3(yd[3], yd[4], yd[5])), alpha_left);
+            }
+        }
+        if(theta_hole <= 1) break;
+        t += h;
+        h = dp45_next_h(h, s.err);
+        for(int i=0; i<6; ++i) {
+            y[i] = s.y1[i];
+            k0[i] = s.k[6][i];
+        }
+        p.pos = vec3(y[0]*rs, y[1]*rs, y[2]*rs);
+        p.vel = normalize(vec3(y[3], y[4], y[5]));
+        if (dotprod(p.vel,p.pos) > 0 && (weak_field ?
+                    weak_field_escape(p, scene.hole->GM, ts.weak_field_tol_rad, scene.disk->radius) :
+                    new_rad > 2*disk_rad)
+            ) {
+            shade_stars(px, scene, ts, p.vel, star_lod(scene, cam_orbit, p.vel), alpha_left);
+            break;
+        }
+    }
+    stats.steps += ctr;
+}
+
+//stepper's dt at radius rad: proportional to the DTP'th power of the radius, but not larger than (DTMF*radius^DTP).
+//integral powers (the usual case) are multiplied out, the same way the packet kernel does it
+double stepper_tick(const TracerSettings &ts, double rad, double sch_rad) {
+    double q = min(rad/sch_rad, ts.dyn_tick_max_factor);
+    int n = stepper_tick_pow(ts);
+    if(n < 0) return ts.min_tick * pow(q, ts.dyn_tick_power);
+    double f = 1;
+    for(int i=0; i<n; ++i) f *= q;
+    return ts.min_tick * f;
+}
+
+//the stepper went from pos (moving along vel) to newpos (along newvel) across the disk plane: shade the hit, if any.
+//false if the ray went into the hole first. the step stays in the plane through the hole, pos and newpos, so the crossing
+//is where that plane's line of nodes lies between them; its radius comes from cubic Hermite interpolation of 1/r over
+//the polar angle, the velocities at both ends giving the slopes (a straight line is 1/r = sin(phi + c)/b), instead of
+//from the chord. steps that are too close to radial, or to the disk plane, for the angles to tell fall back to the chord.
+template<typename Px> bool stepper_crossing(Px &px, Scene &scene, const TracerSettings &ts, vec3 pos, vec3 vel, vec3 newpos, vec3 newvel,
+        const OrbitalPlane &orbit, double &alpha_left) {
+    double r0 = abs(pos), r1 = abs(newpos);
+    vec3 n = crossprod(pos, newpos);
+    double ln = abs(n);
+    vec3 isect, dir;
+    bool on_nodes = false;
+    if(ln > 1e-9*r0*r1 && hypot(n.x, n.y) > 1e-6*ln) {
+        n = div_vec(n, ln);
+        vec3 e1 = div_vec(pos, r0), e2 = crossprod(n, e1);
+        vec3 r1_hat = div_vec(newpos, r1), t1_hat = crossprod(n, r1_hat);
+        double vt0 = dotprod(vel, e2), vt1 = dotprod(newvel, t1_hat);
+        if(vt0 > 1e-6 && vt1 > 1e-6) {
+            double phi1 = atan2(dotprod(newpos, e2), dotprod(newpos, e1));
+            vec3 d(-n.y, n.x, 0);
+            double phi_n = fmod(atan2(dotprod(d, e2), dotprod(d, e1)) + 2*M_PI, M_PI);
+            phi_n = phi_n < phi1 ? phi_n : phi1;
+            //du/dphi = -u*cot(psi), psi being the angle between the velocity and the radius
+            double u0 = 1/r0, u1 = 1/r1, s0 = -u0*dotprod(vel, e1)/vt0, s1 = -u1*dotprod(newvel, r1_hat)/vt1;
+            double t = phi_n/phi1;
+            double u = hermite(u0, s0, u1, s1, phi1, t), du = hermite_slope(u0, s0, u1, s1, phi1, t);
+            vec3 radial = mul_vec(e1, cos(phi_n)) + mul_vec(e2, sin(phi_n));
+            isect = div_vec(radial, u);
+            isect.z = 0;
+            dir = mul_vec(radial, -du/u) + crossprod(n, radial);
+            on_nodes = u > 0;
+        }
+    }
+    if(!on_nodes) {
+        double dz = (newpos-pos).z;
+        isect = mul_vec(newpos, fabs(pos.z / dz)) //find intersection point
+            + mul_vec(pos, fabs(newpos.z / dz));
+        dir = newpos-pos;
+    }
+    double isec_rad=sqrt(isect.x*isect.x + isect.y*isect.y);
+    if(isec_rad < scene.hole->radius) {//goes into hole before intersection
+        return false;
+    } else if(isec_rad < scene.disk->radius) { //hits actual disk
+        shade_disk(px, scene, ts, isect, disk_span(scene, orbit, isect, dir), alpha_left);
+    }
+    return true;
+}
+
+//an escaping ray that dips close to the horizon (near the critical invariant) costs the stepper thousands of its smallest
+//steps on the way around. so once an inbound one is within winding_radius, carry it to where it is back out at the same
+//radius: the passage is symmetric about the turning point w_t, it sweeps twice the quadrature of dphi/dw from here to w_t,
+//and the disk crossings in between come from inverting that quadrature at the line of nodes. true if it did.
+//(in the tracer's model there is no photon sphere outside the horizon, so the sweep stays finite even at the critical
+//invariant: the ray then turns at the horizon itself. captured rays are left to the capture test.)
+template<typename Px> bool stepper_winding(Px &px, Scene &scene, const TracerSettings &ts, Photon &p, double &alpha_left,
+        const OrbitalPlane &cam_orbit, TraceStats &stats) {
+    const double rs = scene.hole->radius;
+    double r = abs(p.pos);
+    if(r >= ts.winding_radius*rs || dotprod(p.pos, p.vel) >= 0) return false;
+    OrbitalPlane orbit(p.pos, p.vel, scene.hole->GM);
+    double w = rs/r, w_t = turning_point(rs/orbit.C, w);
+    if(w_t != w_t) return false;
+    double u_max = sqrt(w_t - w), half = turning_angle(w_t, u_max);
+    for(double phi = angle_to_next_node(orbit, p.pos); phi < 2*half; phi += M_PI) {
+        double u = turning_depth(w_t, fabs(half - phi), u_max), wc = w_t - u*u;
+        if(rs/wc >= scene.disk->radius) continue;
+        //|dw/dphi| = sqrt(F(w)) = 2u/turning_integrand, growing before the turning point and shrinking after
+        double dw = (phi < half ? 2 : -2)*u/turning_integrand(w_t, u);
+        vec3 radial = mul_vec(orbit.e1, cos(phi)) + mul_vec(orbit.e2, sin(phi));
+        vec3 isect = mul_vec(radial, rs/wc);
+        isect.z = 0;
+        vec3 dir = normalize(mul_vec(radial, -dw/wc) + crossprod(orbit.n, radial));
+        shade_disk(px, scene, ts, isect, disk_span(scene, cam_orbit, isect, dir), alpha_left);
+    }
+    //same radius and angle to it on the way out, the radial part of the motion reversed
+    vec3 radial = mul_vec(orbit.e1, cos(2*half)) + mul_vec(orbit.e2, sin(2*half));
+    double vr = dotprod(p.vel, orbit.e1), vt = dotprod(p.vel, orbit.e2);
+    p.pos = mul_vec(radial, r);
+    p.vel = normalize(mul_vec(radial, -vr) + mul_vec(crossprod(orbit.n, radial), vt));
+    ++stats.wound;
+    return true;
+}
+
+//true (and the stars shaded) if the ray is going outwards, away from everything
+template<typename Px> bool stepper_escape(Px &px, Scene &scene, const TracerSettings &ts, Photon &p, const OrbitalPlane &orbit,
+        double alpha_left) {
+    if (dotprod(p.vel,p.pos) > 0 && (ts.weak_field_tol_rad > 0 ?
+                weak_field_escape(p, scene.hole->GM, ts.weak_field_tol_rad, scene.disk->radius) ://finish the bending analytically
+                abs(p.pos) > 2*scene.disk->radius)
+        ) {
+        shade_stars(px, scene, ts, p.vel, star_lod(scene, orbit, p.vel), alpha_left);
+        return true;
+    }
+    return false;
+}
+
+//everything before the stepper: bypass, capture classification, weak-field approach and the other integrators.
+//true if the ray is left for the stepper, starting from p
+template<typename Px> bool begin_ray(Px &px, Scene &scene, const TracerSettings &ts, double x, double y, TraceStats &stats,
+        Photon &p, OrbitalPlane &orbit, bool &captured, double &alpha_left) {
+    p = scene.cam->emit_photon(x,y);
+    alpha_left = 1;
+    orbit = OrbitalPlane(p.pos, p.vel, scene.hole->GM);
+    if(ts.bypass_tol_rad > 0 && weak_field_bypass(p, scene.hole->GM, ts.bypass_tol_rad, scene.disk->radius)) {
+        //never comes near the hole or the disk: only the stars, seen through a slight analytic bend
+        ++stats.bypassed;
+        shade_stars(px, scene, ts, p.vel, star_lod(scene, orbit, p.vel), alpha_left);
+        return false;
+    }
+    if(ts.integrator == INTEGRATE_TABLE && trace_table(px, scene, ts, p, orbit, alpha_left)) {
+        ++stats.tabled;
+        return false;
+    }
+    if(ts.integrator == INTEGRATE_TRANSFER && trace_transfer(px, scene, ts, p, orbit, alpha_left)) {
+        ++stats.tabled;
+        return false;
+    }
+    //an inbound ray below the critical invariant only needs tracing while it can still reach the disk
+    captured = ts.capture_test && CAPTURED == classify_ray(orbit, scene.hole->GM, scene.hole->radius, ts.capture_margin);
+    if(ts.weak_field_tol_rad > 0) {//skip the nearly straight stretch between the camera and the hole
+        weak_field_approach(p, scene.hole->GM, ts.weak_field_tol_rad, scene.disk->radius);
+    }
+    //the tables leave what they decline to binet
+    if((ts.integrator == INTEGRATE_BINET || ts.integrator == INTEGRATE_TABLE || ts.integrator == INTEGRATE_TRANSFER) && trace_binet(px, scene, ts, p, orbit, alpha_left, stats)) {
+        return false;
+    }
+    if(ts.integrator == INTEGRATE_DOPRI) {
+        trace_dopri(px, scene, ts, p, orbit, alpha_left, stats);
+        return false;
+    }
+    return true;
+}
+
+//trace a single pixel; the only shared state touched is read-only, so this is safe to call from any thread
+//x and y may fall between pixel centres (adaptive sampling)
+template<typename Px> Px trace_pixel(Scene &scene, const TracerSettings &ts, double x, double y, TraceStats &stats){
+    unsigned ctr;
     double dt, rad;
-    vec3 newpos;
-    vec3 a, dv0, h;
-    Spectre px, black_px, addpx;
+    vec3 newpos, newvel;
+    vec3 dv0, h;
+    Px px;
     Photon p;
-    double alpha_left, redfact;
-    cerr<<"Rendering";
-    for (int x=0; x<scene.cam->resolution_v; x++){
-        for (int y=0; y<scene.cam->resolution_h; y++){
-            p = scene.cam->emit_photon(x,y);
-            px = black_px;//reset pixel
-            alpha_left = 1;
-            for(ctr = 0; ctr < maxsteps; ++ctr) {//cancel if too far away and going outwards or running for too long
-                rad = abs(p.pos);
-                dt = min_tick * pow(min(rad/scene.hole->radius, dyn_tick_max_factor), dyn_tick_power);//dt is proportional to DTP'th power of radius, but not larger than (DTMF*radius^DTP)
-                newpos = p.pos + mul_vec(p.vel, dt); //move the photon
-                
-                if ( newpos.z * p.pos.z <= 0 ) { //intersects XY plane
-                    double dz = (newpos-p.pos).z;
-                    vec3 isect = mul_vec(newpos, fabs(p.pos.z / dz)) //find intersection point
-                        + mul_vec(p.pos, fabs(newpos.z / dz));
-                    double isec_rad=sqrt(isect.x*isect.x + isect.y*isect.y);
-                    if(isec_rad < scene.hole->radius) {//goes into hole before intersection
-                        break;
-                    } else if(isec_rad < scene.disk->radius) { //hits actual disk
-                        redfact = enable_redshift ? redshift_factor(scene.hole->radius, abs(isect), abs(scene.cam->pos)) : 1;
-                        double used_alpha = scene.disk->get_alpha(isect)*alpha_left/255;
-                        px += scene.disk->get_pixel(isect).shifted(redfact) * used_alpha;
-                        alpha_left -= used_alpha;
-                    }
+    OrbitalPlane orbit;
+    bool captured;
+    double alpha_left;
+    if(!begin_ray(px, scene, ts, x, y, stats, p, orbit, captured, alpha_left)) return px;
+    bool recheck = captured;
+    for(ctr = 0; ctr < ts.maxsteps; ++ctr) {//cancel if too far away and going outwards or running for too long
+        if(recheck) {
+            if(!disk_crossing_ahead(scene, ts, orbit, p.pos, stats)) break;
+            recheck = false;
+        }
+        rad = abs(p.pos);
+        dt = stepper_tick(ts, rad, scene.hole->radius);
+        newpos = p.pos + mul_vec(p.vel, dt); //move the photon
+        //new velocity
+        dv0 = mul_vec( normalize(newpos), dt * scene.hole->GM / (-rad*rad) );
+        h = p.vel + div_vec(dv0, 2.0);
+        newvel = normalize(p.vel + (dv0 - mul_vec(h, dotprod(dv0,h)/dotprod(h,h))));
+        
+        if ( newpos.z * p.pos.z <= 0 ) { //intersects XY plane
+            recheck = captured;
+            if(!stepper_crossing(px, scene, ts, p.pos, p.vel, newpos, newvel, orbit, alpha_left)) break;
+        }
+        if ( abs(newpos) < scene.hole->radius || 
+                abs(newpos-p.pos) > 
+                ( sqrt(dotprod(newpos,newpos) - scene.hole->sqradius) +
+                  sqrt(dotprod(p.pos, p.pos ) - scene.hole->sqradius) ) 
+            ){//intersects hole
+            break;
+        }
+        p.pos = newpos;
+        p.vel = newvel;
+        
+        if(stepper_escape(px, scene, ts, p, orbit, alpha_left)) break;
+        if(ts.winding_radius > 0) stepper_winding(px, scene, ts, p, alpha_left, orbit, stats);
+    }
+    stats.add_ray(ctr);
+    return px;
+}
+
+//the stepper for a whole tile, packet_width rays at a time (see packet.h). a lane whose ray is done takes the
+//next pixel of the tile, so the packet stays full until the tile runs out. same result as trace_pixel.
+template<typename Px> void trace_tile_packets(Scene &scene, const TracerSettings &ts, SpectralImageT<Px> &image,
+        const Tile &t, packet_step_fn step, TraceStats &stats) {
+    struct Lane {
+        int x, y;
+        Px px;
+        OrbitalPlane orbit;
+        bool captured, recheck, active;
+        double alpha_left;
+        unsigned ctr;
+    };
+    Lane lanes[packet_width];
+    PacketLanes L;
+    PacketParams P;
+    P.sch_rad = scene.hole->radius;
+    P.sqrad = scene.hole->sqradius;
+    P.GM = scene.hole->GM;
+    P.min_tick = ts.min_tick;
+    P.max_factor = ts.dyn_tick_max_factor;
+    P.tick_pow = stepper_tick_pow(ts);
+    P.escape_rad = ts.weak_field_tol_rad > 0 ? scene.disk->radius : 2*scene.disk->radius;
+    int next_x = t.x0, next_y = t.y0;//same pixel order as the scalar loop
+    int nactive = 0;
+
+    auto finish = [&](Lane &l) {
+        image.getpx(l.x, l.y) = l.px;
+        stats.add_ray(l.ctr);
+        l.active = false;
+        --nactive;
+    };
+    //start rays until one needs the stepper (or the tile is done), and give it lane i
+    auto refill = [&](int i) {
+        Lane &l = lanes[i];
+        while(next_x < t.x1) {
+            l.x = next_x;
+            l.y = next_y;
+            if(++next_y == t.y1) {
+                next_y = t.y0;
+                ++next_x;
+            }
+            l.px = Px();
+            Photon p;
+            if(!begin_ray(l.px, scene, ts, l.x, l.y, stats, p, l.orbit, l.captured, l.alpha_left)) {
+                image.getpx(l.x, l.y) = l.px;
+                continue;
+            }
+            l.recheck = l.captured;
+            l.ctr = 0;
+            l.active = true;
+            ++nactive;
+            L.x[i] = p.pos.x; L.y[i] = p.pos.y; L.z[i] = p.pos.z;
+            L.vx[i] = p.vel.x; L.vy[i] = p.vel.y; L.vz[i] = p.vel.z;
+            return;
+        }
+    };
+    //what the top of the scalar loop does before a step; refills the lane until it holds a ray that needs one
+    auto ready = [&](int i) {
+        Lane &l = lanes[i];
+        while(l.active) {
+            if(l.ctr >= ts.maxsteps) {
+                finish(l);
+            } else if(l.recheck && !disk_crossing_ahead(scene, ts, l.orbit, vec3(L.x[i], L.y[i], L.z[i]), stats)) {
+                finish(l);
+            } else {
+                l.recheck = false;
+                return;
+            }
+            refill(i);
+        }
+    };
+
+    for(int i=0; i<packet_width; ++i) {
+        lanes[i].active = false;
+        refill(i);
+        ready(i);
+    }
+    while(nactive > 0) {
+        step(L, P);
+        for(int i=0; i<packet_width; ++i) {
+            Lane &l = lanes[i];
+            if(!l.active) continue;
+            long long ev = L.events[i];
+            vec3 pos(L.x[i], L.y[i], L.z[i]), newpos(L.nx[i], L.ny[i], L.nz[i]);
+            bool done = false;
+            if(ev & PACKET_CROSS) {
+                l.recheck = l.captured;
+                vec3 vel(L.vx[i], L.vy[i], L.vz[i]), newvel(L.nvx[i], L.nvy[i], L.nvz[i]);
+                done = !stepper_crossing(l.px, scene, ts, pos, vel, newpos, newvel, l.orbit, l.alpha_left);
+            }
+            done = done || (ev & PACKET_HOLE);
+            if(!done) {
+                L.x[i] = L.nx[i]; L.y[i] = L.ny[i]; L.z[i] = L.nz[i];
+                L.vx[i] = L.nvx[i]; L.vy[i] = L.nvy[i]; L.vz[i] = L.nvz[i];
+                if(ev & PACKET_OUT) {
+                    Photon p(newpos, vec3(L.nvx[i], L.nvy[i], L.nvz[i]));
+                    done = stepper_escape(l.px, scene, ts, p, l.orbit, l.alpha_left);
                 }
-                if ( abs(newpos) < scene.hole->radius || 
-                        abs(newpos-p.pos) > 
-                        ( sqrt(dotprod(newpos,newpos) - scene.hole->sqradius) +
-                          sqrt(dotprod(p.pos, p.pos ) - scene.hole->sqradius) ) 
-                    ){//intersects hole
-                    break;
+                Photon p(vec3(L.x[i], L.y[i], L.z[i]), vec3(L.vx[i], L.vy[i], L.vz[i]));
+                if(!done && ts.winding_radius > 0 && stepper_winding(l.px, scene, ts, p, l.alpha_left, l.orbit, stats)) {
+                    L.x[i] = p.pos.x; L.y[i] = p.pos.y; L.z[i] = p.pos.z;
+                    L.vx[i] = p.vel.x; L.vy[i] = p.vel.y; L.vz[i] = p.vel.z;
                 }
-                //calculate new position
-                p.pos = newpos;
-                //new velocity
-                dv0 = mul_vec( normalize(p.pos), dt * scene.hole->GM / (-rad*rad) );
-                h = p.vel + div_vec(dv0, 2.0);
-                p.vel += dv0 - mul_vec(h, dotprod(dv0,h)/dotprod(h,h));
-                p.vel = normalize(p.vel);
-                
-                if (dotprod(p.vel,p.pos) > 0 && abs(p.pos) > 2*scene.disk->radius) {//going outwards, away from everything
-                    redfact = enable_redshift ? redshift_factor(scene.hole->radius, INFINITY, abs(scene.cam->pos)) : 1;
-                    px += scene.stars->get_pixel(p.vel).shifted(redfact) * alpha_left;
-                    break;    
+            }
+            if(done) {
+                finish(l);
+                refill(i);
+            } else {
+                ++l.ctr;
+            }
+            ready(i);
+        }
+    }
+}
+
+//range of the angles between the frame's rays and the outward camera-hole axis: they are extreme on the border of the
+//frame, unless the axis itself is in view
+void frame_axis_angles(Camera &cam, double &lo, double &hi) {
+    vec3 axis = normalize(cam.pos);
+    lo = M_PI;
+    hi = 0;
+    for(int x=0; x<cam.resolution_v; ++x) {
+        for(int y=0; y<cam.resolution_h; y += (x == 0 || x == cam.resolution_v-1) ? 1 : cam.resolution_h-1) {
+            Photon p = cam.emit_photon(x, y);
+            double psi0 = RayTable::angle_of(p.pos, p.vel);
+            lo = psi0 < lo ? psi0 : lo;
+            hi = psi0 > hi ? psi0 : hi;
+            if(cam.resolution_h == 1) break;
+        }
+    }
+    //the directions along the axis, back in the camera's frame (the inverse of emit_photon)
+    vec3 fwd = cam.rot.rotate(vec3(1,0,0)), left = cam.rot.rotate(vec3(0,1,0)), up = cam.rot.rotate(vec3(0,0,1));
+    for(int sign=-1; sign<=1; sign+=2) {
+        vec3 d = mul_vec(axis, double(sign));
+        double f = dotprod(d, fwd);
+        if(f <= 0) continue;
+        double k = cam.resolution_h/tan(cam.FOV/2)/f;
+        double y = (cam.resolution_h - k*dotprod(d, left))/2, x = (cam.resolution_v - k*dotprod(d, up))/2;
+        if(x >= 0 && x <= cam.resolution_v-1 && y >= 0 && y <= cam.resolution_h-1) {
+            if(sign > 0) lo = 0; else hi = M_PI;
+        }
+    }
+}
+
+//how a pixel will come out in the saved image
+template<typename Px> png::rgb_pixel displayed(const Scene &scene, const Px &px) {
+    return px.to_rgb(*scene.cie, scene.rgb_norm);
+}
+
+//point i of the R2 low-discrepancy sequence (steps of 1/g and 1/g^2, g the plastic number), rotated by (ox, oy) so that
+//neighbouring pixels do not share a pattern, as an offset within (-0.5, 0.5) from a pixel's centre
+void subpixel_offset(int i, double ox, double oy, double &dx, double &dy) {
+    dx = fmod(ox + i*0.7548776662466927, 1.0) - 0.5;
+    dy = fmod(oy + i*0.5698402909980532, 1.0) - 0.5;
+}
+
+//adaptive supersampling of a rendered frame: a pixel whose saved colour differs from one of its 8 neighbours by more
+//than aa_threshold levels in some channel gets more rays, jittered over it, in rounds of 4 until the standard error of
+//its mean colour is under half a level (finer than the output shows) or it has max_spp. its first ray stays the one
+//through the centre. each extra ray stands for about 1/max_spp of the pixel, so it filters the textures over a cone
+//1/sqrt(max_spp) as wide.
+template<typename Px> void refine_pixels(Scene &scene, const TracerSettings &ts, SpectralImageT<Px> &image, std::vector<TraceStats> &thread_stats) {
+    const int xres = scene.cam->resolution_v, yres = scene.cam->resolution_h;
+    const double narrow = 1/sqrt(double(ts.max_spp));
+    if(scene.sky) scene.sky->cone *= narrow;
+    if(scene.disk_footprint) scene.disk_footprint->cone *= narrow;
+    std::vector<png::rgb_pixel> base(size_t(xres)*yres);
+    for(int x=0; x<xres; ++x) {
+        for(int y=0; y<yres; ++y) {
+            base[size_t(x)*yres + y] = displayed(scene, image.getpx(x,y));
+        }
+    }
+    auto differs = [&](png::rgb_pixel a, png::rgb_pixel b) {
+        return abs(int(a.red) - int(b.red)) > ts.aa_threshold || abs(int(a.green) - int(b.green)) > ts.aa_threshold
+            || abs(int(a.blue) - int(b.blue)) > ts.aa_threshold;
+    };
+    run_tiled(xres, yres, ts.tile_size, ts.threads,
+        [&](const Tile &t, unsigned id) {
+            TraceStats stats;
+            for(int x=t.x0; x<t.x1; x++) {
+                for(int y=t.y0; y<t.y1; y++) {
+                    png::rgb_pixel c = base[size_t(x)*yres + y];
+                    bool edge = false;
+                    for(int i=-1; i<=1 && !edge; ++i) {
+                        for(int j=-1; j<=1 && !edge; ++j) {
+                            int u = x+i, v = y+j;
+                            edge = u >= 0 && u < xres && v >= 0 && v < yres && differs(c, base[size_t(u)*yres + v]);
+                        }
+                    }
+                    if(!edge) continue;
+                    ++stats.refined;
+                    Px sum = image.getpx(x,y);
+                    double s1[3] = {double(c.red), double(c.green), double(c.blue)};
+                    double s2[3] = {s1[0]*s1[0], s1[1]*s1[1], s1[2]*s1[2]};
+                    unsigned hash = (unsigned(x)*73856093u) ^ (unsigned(y)*19349663u);
+                    hash = (hash ^ (hash >> 13))*0x5bd1e995u;
+                    double ox = (hash & 0xffff)/65536.0, oy = (hash >> 16)/65536.0;
+                    int n = 1;
+                    while(n < ts.max_spp) {
+                        for(int k=0; k<4 && n < ts.max_spp; ++k, ++n) {
+                            double dx, dy;
+                            subpixel_offset(n, ox, oy, dx, dy);
+                            Px s = trace_pixel<Px>(scene, ts, x + dx, y + dy, stats);
+                            sum += s;
+                            png::rgb_pixel cs = displayed(scene, s);
+                            double v[3] = {double(cs.red), double(cs.green), double(cs.blue)};
+                            for(int ch=0; ch<3; ++ch) {
+                                s1[ch] += v[ch];
+                                s2[ch] += v[ch]*v[ch];
+                            }
+                            ++stats.extra_rays;
+                        }
+                        double err = 0;
+                        for(int ch=0; ch<3; ++ch) {
+                            double var = (s2[ch] - s1[ch]*s1[ch]/n)/(n-1);
+                            err = std::max(err, sqrt(std::max(var, 0.0)/n));
+                        }
+                        if(err <= 0.5) break;
+                    }
+                    sum *= 1.0/n;
+                    image.getpx(x,y) = sum;
                 }
             }
-            scene.cam->image.getpx(x,y) = px;
-            total_steps += ctr;
+            thread_stats[id] += stats;
         }
-        cerr<<'.';
+    );
+    if(scene.sky) scene.sky->cone /= narrow;
+    if(scene.disk_footprint) scene.disk_footprint->cone /= narrow;
+}
+
+#ifdef TEXSIM
+//texel storage the simulated caches count fetches from (index(0,0) is the start of the block in every layout)
+template<typename S, typename Q> void texsim_add (QuantizedTextureT<S,Q> &tex) {
+    if(tex.bytes()) texsim.add(tex.texel_data(0,0), tex.bytes());
+}
+template<typename S> void texsim_add (SpectralImageT<S> &tex) {
+    if(tex.bytes()) texsim.add(&tex.getpx(0,0), tex.bytes());
+}
+template<typename Px> void texsim_add (ShiftedTexture<Px> &tex) {
+    texsim_add(tex.image);
+    for(size_t l=0; l<tex.mips.size(); ++l) texsim_add(tex.mips[l]);
+}
+template<typename Tex> void texsim_add_levels (Tex &tex) {
+    for(int l=0; l<tex.levels(); ++l) texsim_add(tex.level(l));
+    texsim_add(tex.shifted_spectral);
+    texsim_add(tex.shifted_xyz);
+}
+#endif
+
+template<typename Px> void trace_photons(Scene &scene, const TracerSettings &ts, SpectralImageT<Px> &image){
+    //per-thread counters, reduced once all the tiles are done
+    std::vector<TraceStats> thread_stats(ts.threads);
+    if(ts.preshift_stars) {
+        preshift_stars<Px>(scene, ts.enable_redshift ? redshift_factor(scene.hole->radius, INFINITY, abs(scene.cam->pos)) : 1, ts.threads);
+    }
+    if(ts.preshift_disk) {
+        preshift_disk<Px>(scene, ts.enable_redshift, ts.threads);
+    }
+    //how wide each pixel's cone ends up on the sky, for picking the stars' mip level
+    SkyFootprint sky(abs(scene.cam->pos), scene.hole->GM, scene.hole->radius, scene.cam->FOV/scene.cam->resolution_h);
+    scene.sky = scene.stars->levels() > 1 ? &sky : NULL;
+    //and where it lands on the disk, for filtering that
+    bool disk_mipmapped = scene.disk->levels() > 1;
+    DiskFootprint disk_footprint(abs(scene.cam->pos), scene.hole->GM, scene.hole->radius, scene.cam->FOV/scene.cam->resolution_h,
+        disk_mipmapped ? 512 : 0);
+    scene.disk_footprint = disk_mipmapped ? &disk_footprint : NULL;
+    bool tabled = ts.integrator == INTEGRATE_TABLE;
+    std::chrono::steady_clock::time_point table_start = std::chrono::steady_clock::now();
+    double psi_lo = 0, psi_hi = M_PI;
+    if(tabled) {
+        frame_axis_angles(*scene.cam, psi_lo, psi_hi);
+        double pad = (psi_hi - psi_lo)/ts.ray_table_rows;//keep the border rays between rows
+        psi_lo = psi_lo > pad ? psi_lo - pad : 0;
+        psi_hi = psi_hi < M_PI - pad ? psi_hi + pad : M_PI;
+    }
+    RayTable rays(abs(scene.cam->pos), scene.hole->GM, scene.hole->radius, psi_lo, psi_hi, tabled ? ts.ray_table_rows : 0);
+    scene.rays = tabled ? &rays : NULL;
+    TransferStarts transfer_starts;
+    if(scene.transfer) {
+        scene.transfer->place_all(scene.hole->radius/abs(scene.cam->pos), transfer_starts);
+    }
+    scene.transfer_starts = scene.transfer ? &transfer_starts : NULL;
+    if(tabled) {
+        cerr<<"Ray table: "<<rays.rows<<" angles over "<<psi_lo*180/M_PI<<".."<<psi_hi*180/M_PI<<" deg, "
+            <<std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - table_start).count()<<" ms"<<endl;
+    }
+    image = SpectralImageT<Px>(scene.cam->resolution_h, scene.cam->resolution_v);
+    enum packet_isa isa = PACKET_OFF;
+    if(ts.integrator == INTEGRATE_STEPPER && stepper_tick_pow(ts) >= 0) {//packets only do integral tick powers
+        isa = packet_resolve(ts.packets);
+    }
+    packet_step_fn packet_step = packet_kernel(isa);
+    if(packet_step) {
+        cerr<<"Stepper packets: "<<packet_width<<" rays, "<<packet_isa_name(isa)<<endl;
+    }
+#ifdef TEXSIM
+    texsim.ranges.clear();
+    texsim_add_levels(*scene.stars);
+    texsim_add_levels(*scene.disk);
+    if(ts.threads > 1) cerr<<"The simulated texel caches are not thread-safe, run with 1 thread for meaningful counts."<<endl;
+    texsim.on = true;
+#endif
+    cerr<<"Rendering ("<<ts.threads<<" threads)";
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    run_tiled(scene.cam->resolution_v, scene.cam->resolution_h, ts.tile_size, ts.threads,
+        [&](const Tile &t, unsigned id) {
+            TraceStats stats;
+            if(packet_step) {
+                trace_tile_packets(scene, ts, image, t, packet_step, stats);
+            } else {
+                for (int x=t.x0; x<t.x1; x++){
+                    for (int y=t.y0; y<t.y1; y++){
+                        image.getpx(x,y) = trace_pixel<Px>(scene, ts, x, y, stats);
+                    }
+                }
+            }
+            thread_stats[id] += stats;
+            cerr<<'.';
+        }
+    );
+    if(ts.max_spp > 1) {
+        refine_pixels(scene, ts, image, thread_stats);
+    }
+    TraceStats total;
+    for(unsigned i=0; i<thread_stats.size(); ++i) {
+        total += thread_stats[i];
     }
+    unsigned long long npx = scene.cam->resolution_h * scene.cam->resolution_v;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
     cerr<<"Done."<<endl;
-    cerr<<"Avg steps/px: "<<total_steps/(scene.cam->resolution_h * scene.cam->resolution_v)<<endl;
+    cerr<<"Render time: "<<seconds<<" s"<<endl;
+#ifdef TEXSIM
+    texsim.on = false;
+    texsim.report();
+#endif
+    cerr<<"Avg steps/px: "<<total.steps/npx<<endl;
+    if(total.max_steps > 0) {
+        cerr<<"Stepper steps/ray: median "<<total.percentile(0.5)<<", 99% "<<total.percentile(0.99)<<", 99.9% "
+            <<total.percentile(0.999)<<", max "<<total.max_steps<<endl;
+    }
+    if(ts.winding_radius > 0 && ts.integrator == INTEGRATE_STEPPER) {
+        cerr<<"Winding: "<<total.wound<<" rays carried past their turning point"<<endl;
+    }
+    if(ts.max_spp > 1) {
+        cerr<<"Adaptive sampling: "<<total.refined<<" pixels ("<<100.0*total.refined/npx<<"%) refined with "<<total.extra_rays
+            <<" more rays, "<<double(npx + total.extra_rays)/npx<<" rays/px"<<endl;
+    }
+    if(ts.bypass_tol_rad > 0) {
+        cerr<<"Weak-field bypass: "<<total.bypassed<<" rays ("<<100.0*total.bypassed/npx<<"%)"<<endl;
+    }
+    if(ts.integrator == INTEGRATE_TRANSFER) {
+        cerr<<"Transfer table: "<<total.tabled<<" rays ("<<100.0*total.tabled/npx<<"%) shaded from it, the rest integrated"<<endl;
+    }
+    if(tabled) {
+        cerr<<"Ray table: "<<total.tabled<<" rays ("<<100.0*total.tabled/npx<<"%) shaded from it, the rest integrated"<<endl;
+    }
+    if(ts.capture_test) {
+        cerr<<"Capture test: "<<total.captured<<" rays stopped early, ~"<<(unsigned long long)(total.skipped_steps)
+            <<" steps saved ("<<(unsigned long long)(total.skipped_steps/npx)<<"/px)"<<endl;
+    }
 }
 
 const char disk_texture_spectral_fname_fmt[]="textures/spectral/disk/%d.png";
 const char disk_texture_alpha_fname[]="textures/disk_alpha.png";
 const char star_texture_spectral_fname_fmt[]="textures/spectral/stars/%d.png";
+const char disk_texture_cache_fname[]="textures/spectral/disk.spc";
+const char star_texture_cache_fname[]="textures/spectral/stars.spc";
 const char integration_table_fname[]="textures/spectral/cie_xyz.txt";
-const int texture_wvlen_first=380, texture_wvlen_last=700;
+const char transfer_table_fname[]="textures/transfer.tbl";
 
 
 const double tracer_step_min_ratio=2e-3;
@@ -198,9 +1520,109 @@ const double tracer_step_maxratio=5.0;
 
 const double spectral_rgb_norm_mul=0.07;
 
+//optional settings that can follow the output file name in the config
+bool set_option(TracerSettings &ts, const char* key, const char* val) {
+    if(!strcmp(key, "threads")) {
+        int n = atoi(val);
+        ts.threads = n>0 ? n : default_thread_count();
+    } else if(!strcmp(key, "fused_shading")) {
+        ts.fused_shading = atoi(val);
+    } else if(!strcmp(key, "preshift_stars")) {
+        ts.preshift_stars = atoi(val);
+    } else if(!strcmp(key, "preshift_disk")) {
+        ts.preshift_disk = atoi(val);
+    } else if(!strcmp(key, "shift_levels")) {
+        int n = atoi(val);
+        ts.shift_levels = n>1 ? n : ts.shift_levels;
+    } else if(!strcmp(key, "capture_test")) {
+        ts.capture_test = atoi(val);
+    } else if(!strcmp(key, "capture_margin")) {
+        ts.capture_margin = atof(val);
+    } else if(!strcmp(key, "winding_radius")) {
+        ts.winding_radius = atof(val);
+    } else if(!strcmp(key, "weak_field_tol")) {
+        ts.weak_field_tol = atof(val);
+    } else if(!strcmp(key, "bypass_tol")) {
+        ts.bypass_tol = atof(val);
+    } else if(!strcmp(key, "integrator")) {
+        if(!strcmp(val, "stepper")) {
+            ts.integrator = INTEGRATE_STEPPER;
+        } else if(!strcmp(val, "binet")) {
+            ts.integrator = INTEGRATE_BINET;
+        } else if(!strcmp(val, "dopri")) {
+            ts.integrator = INTEGRATE_DOPRI;
+        } else if(!strcmp(val, "table")) {
+            ts.integrator = INTEGRATE_TABLE;
+        } else if(!strcmp(val, "transfer")) {
+            ts.integrator = INTEGRATE_TRANSFER;
+        } else {
+            return false;
+        }
+    } else if(!strcmp(key, "binet_tol")) {
+        ts.binet_tol = atof(val);
+    } else if(!strcmp(key, "dopri_tol")) {
+        ts.dopri_tol = atof(val);
+    } else if(!strcmp(key, "ray_table_rows")) {
+        int n = atoi(val);
+        ts.ray_table_rows = n>1 ? n : ts.ray_table_rows;
+    } else if(!strcmp(key, "max_spp")) {
+        int n = atoi(val);
+        ts.max_spp = n>0 ? n : ts.max_spp;
+    } else if(!strcmp(key, "aa_threshold")) {
+        ts.aa_threshold = atof(val);
+    } else if(!strcmp(key, "transfer_tol")) {
+        ts.transfer_tol = atof(val);
+    } else if(!strcmp(key, "packets")) {
+        if(!strcmp(val, "off")) {
+            ts.packets = PACKET_OFF;
+        } else if(!strcmp(val, "scalar")) {
+            ts.packets = PACKET_SCALAR;
+        } else if(!strcmp(val, "avx2")) {
+            ts.packets = PACKET_AVX2;
+        } else if(!strcmp(val, "avx512")) {
+            ts.packets = PACKET_AVX512;
+        } else if(!strcmp(val, "auto")) {
+            ts.packets = PACKET_AUTO;
+        } else {
+            return false;
+        }
+    } else if(!strcmp(key, "texture_layout")) {
+        if(!strcmp(val, "rows")) {
+            ts.texture_layout = LAYOUT_ROWS;
+        } else if(!strcmp(val, "tiles")) {
+            ts.texture_layout = LAYOUT_TILES;
+        } else if(!strcmp(val, "morton")) {
+            ts.texture_layout = LAYOUT_MORTON;
+        } else {
+            return false;
+        }
+    } else if(!strcmp(key, "star_projection")) {
+        if(!strcmp(val, "cube")) {
+            ts.star_projection = STARS_CUBE;
+        } else if(!strcmp(val, "equirect")) {
+            ts.star_projection = STARS_EQUIRECT;
+        } else {
+            return false;
+        }
+    } else if(!strcmp(key, "star_mipmaps")) {
+        ts.star_mipmaps = atoi(val);
+    } else if(!strcmp(key, "disk_mipmaps")) {
+        ts.disk_mipmaps = atoi(val);
+    } else if(!strcmp(key, "disk_anisotropy")) {
+        int n = atoi(val);
+        ts.disk_anisotropy = n>0 ? n : ts.disk_anisotropy;
+    } else if(!strcmp(key, "tile_size")) {
+        int n = atoi(val);
+        ts.tile_size = n>0 ? n : ts.tile_size;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char ** argv) {
     if(argc<2) {
-        cerr<<"Usage: "<<argv[0]<<" <config_file>"<<endl;
+        cerr<<"Usage: "<<argv[0]<<" <config_file> [threads] [key=value]..."<<endl;
         return 65;
     }
     FILE* inf = fopen(argv[1], "r");
@@ -226,33 +1648,95 @@ int main(int argc, char ** argv) {
     } else {
         ofname = buf;    
     }
+    TracerSettings ts;
+    ts.threads = default_thread_count();
+    char key[64], val[2048];
+    while(2 == fscanf(inf, "%63s %2047s", key, val)) {//optional "<key> <value>" lines
+        if(!set_option(ts, key, val)) {
+            cerr<<"Unknown config option \""<<key<<"\", ignored."<<endl;
+        }
+    }
     fclose(inf);
+    if(argc>2) {//thread count on the command line takes precedence
+        set_option(ts, "threads", argv[2]);
+    }
+    for(int i=3; i<argc; ++i) {//and so do "<key>=<value>" options after it
+        char* eq = strchr(argv[i], '=');
+        if(eq) *eq = 0;
+        if(!eq || !set_option(ts, argv[i], eq+1)) {
+            cerr<<"Bad option \""<<argv[i]<<"\", ignored."<<endl;
+        }
+    }
     
     Camera cam(vec3(x,y,z), Rotation((M_PI/180)*yaw, (M_PI/180)*pitch, (M_PI/180)*roll), xres, yres, cam_fov*M_PI/180);
     BlackHole hole(GM);
     cerr<<"Schwarzschild radius: "<<hole.radius<<" LS"<<endl;
 
     cerr<<"Loading textures.";
-    SpectralImage disk_texture(texture_wvlen_first, texture_wvlen_last, disk_texture_spectral_fname_fmt);
+    //8-bit sources: kept as bytes, mapped straight from the cache when it was saved in the same layout
+    QuantizedTexture disk_texture(texture_wvlen_first, texture_wvlen_last, disk_texture_spectral_fname_fmt, disk_texture_cache_fname, ts.texture_layout);
     AccretionDisk accd(
         hole.radius * disk_size_ratio, 
-        disk_texture,
+        std::move(disk_texture),
         png::image<png::gray_pixel>("textures/disk_alpha.png"),
         texture_filtering
     );
     cerr<<"."; 
-    SpectralImage star_texture(texture_wvlen_first, texture_wvlen_last, star_texture_spectral_fname_fmt);
-    StarField stars(star_texture, texture_filtering);
+    QuantizedTexture star_texture(texture_wvlen_first, texture_wvlen_last, star_texture_spectral_fname_fmt, star_texture_cache_fname, ts.texture_layout);
+    StarField stars(std::move(star_texture), texture_filtering);
+    if(ts.star_mipmaps) {
+        stars.build_mips(ts.texture_layout);
+    }
+    if(ts.star_projection == STARS_CUBE) {
+        stars.build_cube(ts.threads);
+    }
+    if(ts.disk_mipmaps) {
+        accd.build_mips(ts.texture_layout);
+    }
+    accd.anisotropy = ts.disk_anisotropy;
     cerr<<".Done."<<endl;
+    cerr<<"Texture memory: stars "<<stars.bytes()/1048576<<" MB, disk "<<accd.bytes()/1048576<<" MB, "<<texel_layout_name(ts.texture_layout)<<" layout, stars as "<<(stars.projection == STARS_CUBE ? "cube map" : "panorama")<<", "<<stars.levels()<<" level(s), disk "<<accd.levels()<<" level(s)"<<endl;
     
     Scene scene(&cam, &hole, &accd, &stars);
+    IntTable integ_tbl(integration_table_fname);
+    scene.cie = &integ_tbl;
+    scene.rgb_norm = spectral_rgb_norm_mul;
      
-    double tracer_step_min = tracer_step_min_ratio * hole.radius;
-    int max_steps = 5*round(abs(cam.pos)/tracer_step_min);
-    
-    trace_photons(scene, tracer_step_min, tracer_step_pow, tracer_step_maxratio, max_steps, apply_redshift);
+    ts.min_tick = tracer_step_min_ratio * hole.radius;
+    ts.dyn_tick_power = tracer_step_pow;
+    ts.dyn_tick_max_factor = tracer_step_maxratio;
+    ts.maxsteps = 5*round(abs(cam.pos)/ts.min_tick);
+    ts.enable_redshift = apply_redshift;
+    ts.weak_field_tol_rad = ts.weak_field_tol * cam.FOV / cam.resolution_h;
+    ts.bypass_tol_rad = ts.bypass_tol * cam.FOV / cam.resolution_h;
+    ts.transfer_tol_rad = ts.transfer_tol * cam.FOV / cam.resolution_h;
+
+    TransferTable transfer;
+    if(ts.integrator == INTEGRATE_TRANSFER) {
+        //mapped from the file bin/transfertab writes, or built here (and saved for next time) if it is missing or stale
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        bool mapped = transfer.map(transfer_table_fname, TransferTable::default_header());
+        if(!mapped) {
+            transfer.build(TransferTable::default_header(), ts.threads);
+            if(!transfer.write(transfer_table_fname)) {
+                cerr<<"Could not save the transfer table to \""<<transfer_table_fname<<"\"."<<endl;
+            }
+        }
+        cerr<<"Transfer table: "<<transfer.get_header().rows<<" orbits, "<<transfer.size()/1048576<<" MB, "
+            <<(mapped ? "mapped" : "built")<<" in "<<std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count()<<" ms"<<endl;
+        scene.transfer = &transfer;
+    }
     
-    IntTable integ_tbl(integration_table_fname);
-    cerr<<"Saving image to \""<<ofname<<"\"..."<<endl;
-    cam.image.toRGB(integ_tbl,spectral_rgb_norm_mul).write(ofname);
+    if(ts.fused_shading) {
+        ShiftResponse response(integ_tbl, ts.shift_levels);
+        cerr<<"Shift response table: "<<ts.shift_levels<<" levels over f in ["<<response.f_min<<", "<<response.f_max<<"], max rel. error "<<response.max_error()<<endl;
+        scene.response = &response;
+        trace_photons(scene, ts, cam.xyz_image);
+        cerr<<"Saving image to \""<<ofname<<"\"..."<<endl;
+        cam.xyz_image.toRGB(integ_tbl,spectral_rgb_norm_mul).write(ofname);
+    } else {
+        trace_photons(scene, ts, cam.image);
+        cerr<<"Saving image to \""<<ofname<<"\"..."<<endl;
+        cam.image.toRGB(integ_tbl,spectral_rgb_norm_mul).write(ofname);
+    }
 }
@@ -0,0 +1,545 @@
+#ifndef _ORBIT_H
+#define _ORBIT_H
+
+#include "3d.h"
+#include <cmath>
+#include <vector>
+
+//The tracer bends photons with the perpendicular part of newtonian gravity, keeping |v| = 1.
+//That keeps the orbit in the plane of r and v, but |L| = |r x v| is not conserved as in GR:
+//d|L|/dt = -(g.v)|L| = (GM/r^2)(dr/dt)|L|, hence C = |L|*exp(GM/r) is the invariant of the motion.
+//With v = 1, |L| = r*sin(psi) (psi being the angle between v and the radius), so a ray turns around
+//where h(r) = r*exp(GM/r) equals C. h grows monotonically for r > GM, thus an inbound ray whose C is
+//below h(r_s) never turns and falls in, while anything else gets away.
+//All of this is for the tracer's model, not for exact Schwarzschild geodesics (where b_crit = 3*sqrt(3)*GM).
+
+enum ray_fate{ESCAPING, CAPTURED, NEAR_CRITICAL};
+
+struct OrbitalPlane {
+    vec3 e1, e2;//orthonormal basis of the plane, e1 along the starting position
+    vec3 n;//normal, along r x v
+    double C;//invariant, see above
+    bool inbound;
+    OrbitalPlane() {}
+    OrbitalPlane(vec3 pos, vec3 vel, double GM) {
+        double r = abs(pos);
+        e1 = div_vec(pos, r);
+        vec3 l = crossprod(pos, vel);
+        double L = abs(l);
+        n = L > 0 ? div_vec(l, L) : vec3(0,0,1);
+        e2 = crossprod(n, e1);
+        C = L*exp(GM/r);
+        inbound = dotprod(pos, vel) < 0;
+    }
+    double angle(vec3 pos) const {//polar angle of pos within the plane, grows along the motion
+        return atan2(dotprod(pos, e2), dotprod(pos, e1));
+    }
+};
+
+double capture_invariant_crit(double GM, double sch_rad) {
+    return sch_rad*exp(GM/sch_rad);
+}
+
+//margin is the relative width of the band around the critical value that is left to the integrator
+enum ray_fate classify_ray(const OrbitalPlane &o, double GM, double sch_rad, double margin) {
+    double crit = capture_invariant_crit(GM, sch_rad);
+    if(o.C > crit*(1+margin) || !o.inbound) return ESCAPING;
+    if(o.C < crit*(1-margin)) return CAPTURED;
+    return NEAR_CRITICAL;
+}
+
+//angle until the plane the orbit lies in next meets z=0, looking from pos along the motion.
+//crossings happen at the line of nodes and every pi after it. INFINITY if the orbit lies in (or
+//too close to) the disk plane for the nodes to be meaningful.
+double angle_to_next_node(const OrbitalPlane &o, vec3 pos) {
+    vec3 d(-o.n.y, o.n.x, 0);//z x n
+    if(abs(d) < 1e-9) return INFINITY;
+    double dphi = o.angle(d) - o.angle(pos);
+    dphi = fmod(dphi, M_PI);
+    if(dphi <= 0) dphi += M_PI;
+    return dphi;
+}
+
+//for a captured ray at radius r: angle it still sweeps before reaching sch_rad, and the number of
+//tracer steps that would take (step size dt(r) = min_tick*min(r/sch_rad, max_factor)^power).
+//simpson over r; the integrands are finite because sin(psi) stays below 1 for captured rays.
+void captured_descent(double r, double C, double GM, double sch_rad,
+        double min_tick, double tick_power, double tick_max_factor,
+        double &sweep, double &steps, int intervals=64) {
+    sweep = 0;
+    steps = 0;
+    if(r <= sch_rad) return;
+    double hstep = (r - sch_rad)/intervals;
+    for(int i=0; i<=intervals; ++i) {
+        double rr = sch_rad + i*hstep;
+        double s = C*exp(-GM/rr)/rr;//sin(psi)
+        if(s > 1) s = 1;
+        double c = sqrt(1 - s*s);
+        if(c < 1e-6) c = 1e-6;
+        double dt = min_tick * pow(rr/sch_rad < tick_max_factor ? rr/sch_rad : tick_max_factor, tick_power);
+        double w = (i==0 || i==intervals) ? 1 : (i%2 ? 4 : 2);
+        sweep += w * s/(c*rr);
+        steps += w / (c*dt);
+    }
+    sweep *= hstep/3;
+    steps *= hstep/3;
+}
+
+//Weak field: far from the hole a ray is nearly straight, x(s) = x0 + v*(s - s0) with s = x.v, and to first order
+//it only picks up the integral of the perpendicular pull along that line. With b the vector from the centre to
+//the closest point of the line (|b| = impact parameter), g_perp = -GM*b/|x|^3, which integrates in closed form.
+//Compared to integrating the tracer's equations precisely, the direction error of doing the whole way from
+//radius r out to infinity this way stays below weak_field_err_coef*(GM/r)^2*sin(psi), psi being the angle
+//between the ray and the radius (measured over r = 20..1000 GM; the coefficient is a little above the worst case).
+const double weak_field_err_coef = 0.6;
+
+//integral of ds/(b^2+s^2)^(3/2) from -infinity to s, written so that it does not cancel for small b
+double weak_field_pull(double b, double s) {
+    double q = sqrt(b*b + s*s);
+    if(s <= 0) return 1/(q*(q-s));
+    return 2/(b*b) - 1/(q*(q+s));
+}
+
+//same integral from s to +infinity
+double weak_field_pull_rest(double b, double s) {
+    double q = sqrt(b*b + s*s);
+    if(s > 0) return 1/(q*(q+s));
+    return 2/(b*b) - 1/(q*(q-s));
+}
+
+//radius from which on a ray with impact parameter b may be treated as straight with first-order bending
+double weak_field_radius(double GM, double b, double tol) {
+    return cbrt(weak_field_err_coef*GM*GM*b/tol);
+}
+
+//move an inbound photon along its first-order path to the radius where the weak-field error reaches tol
+//(but not into min_rad, which must enclose everything it could hit). false if it was left alone.
+bool weak_field_approach(Photon &p, double GM, double tol, double min_rad) {
+    double r0 = abs(p.pos);
+    double s0 = dotprod(p.pos, p.vel);
+    if(s0 >= 0) return false;//not coming closer
+    vec3 bv = p.pos - mul_vec(p.vel, s0);
+    double b = abs(bv);
+    double R = weak_field_radius(GM, b, tol);
+    if(R < min_rad) R = min_rad;
+    if(R >= r0 || b >= R) return false;//already inside, or the line never gets that close
+    double s1 = -sqrt(R*R - b*b);
+    double q0 = sqrt(b*b + s0*s0), q1 = sqrt(b*b + s1*s1);
+    double dv = weak_field_pull(b, s1) - weak_field_pull(b, s0);
+    double dx = s1*dv + 1/q1 - 1/q0;//integral of (s1-s)/(b^2+s^2)^(3/2)
+    p.pos += mul_vec(p.vel, s1 - s0) - mul_vec(bv, GM*dx);
+    p.vel = normalize(p.vel - mul_vec(bv, GM*dv));
+    return true;
+}
+
+//for an outbound photon beyond min_rad: if the rest of the way out can be done to first order within tol,
+//turn its velocity into the direction it will end up with at infinity and return true.
+bool weak_field_escape(Photon &p, double GM, double tol, double min_rad) {
+    double r = abs(p.pos);
+    if(r <= min_rad) return false;
+    double s = dotprod(p.pos, p.vel);
+    vec3 bv = p.pos - mul_vec(p.vel, s);
+    double b = abs(bv);
+    if(weak_field_err_coef*GM*GM*b > tol*r*r*r) return false;
+    p.vel = normalize(p.vel - mul_vec(bv, GM*weak_field_pull_rest(b, s)));
+    return true;
+}
+
+//a ray that passes its closest point collects more second-order error than the two halves suggest:
+//measured the same way, the direction error of a whole pass stays below weak_field_pass_coef*(GM/b)^2
+const double weak_field_pass_coef = 3.5;
+
+//whole ray in one go: if the straight line from the camera never gets within min_rad, and bending all the way
+//to infinity is within tol to first order, set the final direction and return true.
+bool weak_field_bypass(Photon &p, double GM, double tol, double min_rad) {
+    double s = dotprod(p.pos, p.vel);
+    if(s >= 0) return weak_field_escape(p, GM, tol, min_rad);
+    vec3 bv = p.pos - mul_vec(p.vel, s);
+    double b = abs(bv);
+    if(b <= min_rad || weak_field_pass_coef*GM*GM > tol*b*b) return false;
+    p.vel = normalize(p.vel - mul_vec(bv, GM*weak_field_pull_rest(b, s)));
+    return true;
+}
+
+//Orbit equation: in the orbital plane, with w = r_s/r as a function of the polar angle phi, dr/dphi = r^2*cot(psi)/r
+//and the invariant give (dw/dphi)^2 = (r_s/C)^2*exp(w) - w^2 (GM = r_s/2), which differentiates into the Binet-like
+//w'' = kappa*exp(w) - w, kappa = r_s^2/(2*C^2). Being second order it has no trouble at turning points;
+//w = 1 is the horizon and w = 0 is infinity, where the polar angle is the final direction of the ray.
+struct BinetOrbit {
+    double kappa;
+    void operator()(double, const double* y, double* dy) const {
+        dy[0] = y[1];
+        dy[1] = kappa*exp(y[0]) - y[0];
+    }
+};
+
+//the tracer's own equations of motion in units of r_s (GM = 1/2): y = (pos, vel), dpos/ds = vel and
+//dvel/ds = the part of -pos/(2|pos|^3) perpendicular to vel. for general-purpose integrators.
+struct TracerField {
+    void operator()(double, const double* y, double* dy) const {
+        double r2 = y[0]*y[0] + y[1]*y[1] + y[2]*y[2];
+        double k = -0.5/(r2*sqrt(r2));
+        double v2 = y[3]*y[3] + y[4]*y[4] + y[5]*y[5];
+        double gv = k*(y[0]*y[3] + y[1]*y[4] + y[2]*y[5])/v2;
+        for(int i=0; i<3; ++i) {
+            dy[i] = y[i+3];
+            dy[i+3] = k*y[i] - gv*y[i+3];
+        }
+    }
+};
+
+//w and dw/dphi at the start of the plane (phi = 0 along pos); false for a ray that is (numerically) radial
+bool binet_start(const OrbitalPlane &o, vec3 pos, vec3 vel, double GM, double sch_rad, BinetOrbit &orb, double* y) {
+    double r = abs(pos);
+    double L = o.C*exp(-GM/r);
+    if(L < 1e-9*r) return false;
+    orb.kappa = sch_rad*sch_rad/(2*o.C*o.C);
+    y[0] = sch_rad/r;
+    y[1] = -sch_rad*dotprod(pos, vel)/(r*L);
+    return true;
+}
+
+//where an escaping ray with a = r_s/C, now at w0 and inbound, turns: F(w_t) = 0 (see escape_angle), i.e. w*exp(-w/2) = a,
+//which grows with w up to w = 2. NAN if it does not turn before the horizon.
+double turning_point(double a, double w0) {
+    if(a*exp(0.5) >= 1) return NAN;
+    double lo = w0, hi = 1;
+    for(int k=0; k<60; ++k) {
+        double mid = (lo+hi)/2;
+        if(mid*exp(-mid/2) < a) lo = mid; else hi = mid;
+    }
+    return (lo+hi)/2;
+}
+
+//2u/sqrt(F(w_t - u^2)) = dphi/du near the turning point w_t, written so that it does not cancel for small u
+double turning_integrand(double w_t, double u) {
+    double u2 = u*u;
+    return u < 1e-6 ? 2/sqrt(2*w_t - w_t*w_t) : 2/sqrt((w_t*w_t*expm1(-u2) + 2*w_t*u2 - u2*u2)/u2);
+}
+
+//polar angle a ray sweeps between w = w_t - u^2 and its turning point w_t (simpson over u)
+double turning_angle(double w_t, double u, int intervals=64) {
+    double hstep = u/intervals, sum = 0;
+    for(int i=0; i<=intervals; ++i) {
+        double wt = (i==0 || i==intervals) ? 1 : (i%2 ? 4 : 2);
+        sum += wt*turning_integrand(w_t, i*hstep);
+    }
+    return sum*hstep/3;
+}
+
+//the inverse: u in [0, u_max] at which the ray is angle away from its turning point (newton, bracketed)
+double turning_depth(double w_t, double angle, double u_max) {
+    double lo = 0, hi = u_max, u = u_max*angle/turning_angle(w_t, u_max);
+    for(int k=0; k<50; ++k) {
+        if(!(u > lo && u < hi)) u = (lo+hi)/2;
+        double f = turning_angle(w_t, u) - angle;
+        if(f < 0) lo = u; else hi = u;
+        double next = u - f/turning_integrand(w_t, u);
+        if(fabs(next - u) < 1e-12 || hi - lo < 1e-12) return next > lo && next < hi ? next : u;
+        u = next;
+    }
+    return u;
+}
+
+//(dw/dphi)^2 = F(w) = a^2*exp(w) - w^2 with a = r_s/C (see BinetOrbit). the polar angle at which a ray starting at w0 reaches
+//w = 0, i.e. the direction it leaves in, measured from pos like the initial direction psi0 is. outbound that is the integral
+//of dw/sqrt(F) over [0, w0]; inbound the ray first goes on to its turning point w_t (F(w_t) = 0) and back, with w = w_t - u^2
+//taking the inverse square root singularity out. NAN if the ray does not turn before the horizon.
+double escape_angle(double r0, double psi0, double GM, double sch_rad, int intervals=64) {
+    double w0 = sch_rad/r0;
+    double s = sin(psi0);
+    if(s < 1e-12) return psi0 < M_PI/2 ? 0 : NAN;
+    double a = sch_rad/(r0*s*exp(GM/r0));
+    double sum = 0;
+    if(psi0 <= M_PI/2) {
+        double hstep = w0/intervals;
+        for(int i=0; i<=intervals; ++i) {
+            double w = i*hstep;
+            double wt = (i==0 || i==intervals) ? 1 : (i%2 ? 4 : 2);
+            sum += wt/sqrt(a*a*exp(w) - w*w);
+        }
+        return sum*hstep/3;
+    }
+    double w_t = turning_point(a, w0);
+    if(w_t != w_t) return NAN;
+    double ends[2] = {sqrt(w_t), sqrt(w_t - w0)};
+    for(int e=0; e<2; ++e) {
+        double hstep = ends[e]/intervals;
+        for(int i=0; i<=intervals; ++i) {
+            double wt = (i==0 || i==intervals) ? 1 : (i%2 ? 4 : 2);
+            sum += wt*turning_integrand(w_t, i*hstep)*hstep/3;
+        }
+    }
+    return sum;
+}
+
+//How much a ray's cone widens on its way from radius r0 out to the sky. The problem is symmetric about the axis through
+//the starting point, so a ray is fixed by its angle psi0 to that axis, and a small cone around it ends up stretched by
+//d(escape_angle)/d(psi0) within the orbital plane and by sin(chi)/sin(psi0) across it, chi being the angle of the final
+//direction to the axis (the plane just turns about the axis). The first factor is tabulated over psi0 once per radius.
+struct SkyFootprint {
+    double r0, GM, sch_rad;
+    double cone;//angular width of a ray's cone at the start
+    std::vector<double> radial;//d(escape_angle)/d(psi0) on a uniform grid over [0, pi], 1e30 next to captured rays
+    SkyFootprint(double r, double gm, double rs, double cone_width, int n=2048) {
+        r0 = r;
+        GM = gm;
+        sch_rad = rs;
+        cone = cone_width;
+        std::vector<double> phi(n+1);
+        for(int i=0; i<=n; ++i) {
+            phi[i] = escape_angle(r0, M_PI*i/n, GM, sch_rad);
+        }
+        radial.resize(n+1);
+        for(int i=0; i<=n; ++i) {
+            int lo = i ? i-1 : 0, hi = i<n ? i+1 : n;
+            double d = fabs(phi[hi] - phi[lo])/(M_PI*(hi-lo)/n);
+            radial[i] = d == d ? d : 1e30;
+        }
+    }
+    //angular width on the sky of the cone of a ray that left r0 on orbit o (which must start there) and escaped along dir
+    double width(const OrbitalPlane &o, vec3 dir) const {
+        double s = o.C*exp(-GM/r0)/r0;//sin(psi0)
+        s = s < 1 ? s : 1;
+        double psi0 = o.inbound ? M_PI - asin(s) : asin(s);
+        double x = psi0/M_PI*(radial.size()-1);
+        int i = x;
+        i = i < int(radial.size())-2 ? i : int(radial.size())-2;
+        double f = x - i;
+        double stretch = radial[i]*(1-f) + radial[i+1]*f;
+        if(s > 1e-6) {
+            double across = abs(crossprod(dir, o.e1))/s;
+            stretch = across > stretch ? across : stretch;
+        }
+        return cone*stretch;
+    }
+};
+
+//The orbit equation (see BinetOrbit) of the ray leaving r0 at angle psi0 to the radius, together with its variation in
+//psi0: u = dw/dpsi0 at fixed phi obeys u'' = (kappa*exp(w) - 1)*u + exp(w)*dkappa/dpsi0, dkappa/dpsi0 = -2*kappa*cot(psi0).
+//y = (w, w', u, u'), integrated with fixed RK4 steps over phi.
+struct OrbitVariation {
+    double w0, kappa, dkappa, cot;
+    OrbitVariation(double r0, double GM, double sch_rad, double psi0) {
+        double s = sin(psi0);
+        cot = cos(psi0)/s;
+        w0 = sch_rad/r0;
+        kappa = sch_rad*sch_rad/(2*r0*r0*s*s*exp(2*GM/r0));
+        dkappa = -2*kappa*cot;
+    }
+    void start(double* y) const {
+        y[0] = w0;
+        y[1] = -w0*cot;
+        y[2] = 0;
+        y[3] = w0*(1 + cot*cot);
+    }
+    void operator()(const double* y, double* dy) const {
+        double e = exp(y[0]);
+        dy[0] = y[1];
+        dy[1] = kappa*e - y[0];
+        dy[2] = y[3];
+        dy[3] = (kappa*e - 1)*y[2] + dkappa*e;
+    }
+    void step(double* y, double h) const {
+        double k1[4], k2[4], k3[4], k4[4], t[4];
+        (*this)(y, k1);
+        for(int q=0; q<4; ++q) t[q] = y[q] + h/2*k1[q];
+        (*this)(t, k2);
+        for(int q=0; q<4; ++q) t[q] = y[q] + h/2*k2[q];
+        (*this)(t, k3);
+        for(int q=0; q<4; ++q) t[q] = y[q] + h*k3[q];
+        (*this)(t, k4);
+        for(int q=0; q<4; ++q) y[q] += h/6*(k1[q] + 2*k2[q] + 2*k3[q] + k4[q]);
+    }
+};
+
+//Where a ray's cone lands on the disk. Within the orbital plane a neighbouring ray (psi0 + d) still crosses at the same
+//polar angles, the nodes, so the hit only moves radially, by dr/dpsi0 at fixed phi: u from OrbitVariation, integrated
+//over a grid of psi0 and tabulated over phi. Across the plane the neighbour is the same
+//trajectory turned about the axis by d/sin(psi0), moving the hit along e1 x hit; taken back along the ray into z=0
+//that displacement grows as 1/|dir.z|, which is the long axis at grazing crossings.
+struct DiskFootprint {
+    double r0, GM, sch_rad;
+    double cone;//angular width of a ray's cone at the start
+    int rows, cols;//psi0 = pi*(i+0.5)/rows; phi = j*dphi, up to 3*pi
+    double dphi;
+    std::vector<float> w, u;//by row, NAN once the ray has escaped or fallen in
+    DiskFootprint(double r, double gm, double rs, double cone_width, int n=512, int per_pi=128) {
+        r0 = r;
+        GM = gm;
+        sch_rad = rs;
+        cone = cone_width;
+        rows = n;
+        cols = 3*per_pi + 1;
+        dphi = M_PI/per_pi;
+        w.assign(size_t(rows)*cols, NAN);
+        u.assign(size_t(rows)*cols, NAN);
+        for(int i=0; i<rows; ++i) {
+            double psi0 = M_PI*(i+0.5)/rows;
+            OrbitVariation f(r0, GM, sch_rad, psi0);
+            double y[4];
+            f.start(y);
+            for(int j=0; j<cols && y[0] > 0 && y[0] < 1; ++j) {
+                w[size_t(i)*cols + j] = y[0];
+                u[size_t(i)*cols + j] = y[2];
+                f.step(y, dphi/2);
+                f.step(y, dphi/2);
+            }
+        }
+    }
+    //the footprint of a ray that left r0 on orbit o and crosses z=0 at hit heading along dir: the parallelogram spanned
+    //by a (across the orbital plane) and b (radial). false, leaving them alone, if the table does not cover the ray.
+    bool axes(const OrbitalPlane &o, vec3 hit, vec3 dir, vec3 &a, vec3 &b) const {
+        double s = o.C*exp(-GM/r0)/r0;//sin(psi0)
+        s = s < 1 ? s : 1;
+        if(s < 1e-6) return false;
+        double psi0 = o.inbound ? M_PI - asin(s) : asin(s);
+        double x = psi0/M_PI*rows - 0.5;
+        x = x > 0 ? x : 0;
+        int i = x;
+        i = i < rows-2 ? i : rows-2;
+        double fx = x - i < 1 ? x - i : 1;
+        double r = abs(hit), wh = sch_rad/r;
+        double phi = o.angle(hit);
+        if(phi < 0) phi += 2*M_PI;
+        //the polar angle is only known up to whole turns: take the turn whose radius matches
+        double best = INFINITY, du = 0;
+        for(; phi < (cols-1)*dphi; phi += 2*M_PI) {
+            double y = phi/dphi;
+            int j = y;
+            double fy = y - j;
+            size_t c = size_t(i)*cols + j;
+            double wc[4] = {w[c], w[c+1], w[c+cols], w[c+cols+1]};
+            double uc[4] = {u[c], u[c+1], u[c+cols], u[c+cols+1]};
+            double wt[4] = {(1-fx)*(1-fy), (1-fx)*fy, fx*(1-fy), fx*fy};
+            double wi = 0, ui = 0;
+            for(int k=0; k<4; ++k) {
+                wi += wc[k]*wt[k];
+                ui += uc[k]*wt[k];
+            }
+            if(wi == wi && fabs(wi - wh) < best) {
+                best = fabs(wi - wh);
+                du = ui;
+            }
+        }
+        if(best == INFINITY) return false;
+        b = mul_vec(hit, cone*fabs(du)/(wh*wh)*sch_rad/r);
+        vec3 t = crossprod(o.e1, hit);
+        double dz = fabs(dir.z) > 1e-3 ? dir.z : (dir.z < 0 ? -1e-3 : 1e-3);
+        a = mul_vec(t - mul_vec(dir, t.z/dz), cone/s);
+        return true;
+    }
+};
+
+//cubic Hermite interpolation over [0, h] between a and b with slopes da and db, at t in [0, 1], and its slope there
+double hermite(double a, double da, double b, double db, double h, double t) {
+    double t2 = t*t, t3 = t2*t;
+    return (2*t3 - 3*t2 + 1)*a + (t3 - 2*t2 + t)*h*da + (3*t2 - 2*t3)*b + (t3 - t2)*h*db;
+}
+
+double hermite_slope(double a, double da, double b, double db, double h, double t) {
+    double t2 = t*t;
+    return ((6*t2 - 6*t)*(a - b))/h + (3*t2 - 4*t + 1)*da + (3*t2 - 2*t)*db;
+}
+
+//Every ray from the camera is fixed, up to a turn about the camera-hole axis, by its angle psi0 to that axis, so a frame's
+//orbits are a one-parameter family. RayTable integrates it once per frame on a grid of psi0 (OrbitVariation, sampled every
+//dphi) and records where each row ends: escaping at w = 0, whose polar angle is the final direction, or falling in at w = 1.
+//A ray then only needs its psi0 and its line of nodes: its disk crossings are the table's radii at the node angles and its
+//direction to the stars is the end angle, interpolated with cubic Hermite in phi (slope w') and across psi0 (slope u, and
+//-u/w' for the end angle). Rows are followed a couple of samples past their end so that this holds right up to it. Around
+//the critical angle the orbits wind and neighbouring rows part ways; the table declines those rays.
+struct RayTable {
+    double r0, GM, sch_rad;
+    int rows, cols;//psi0 = psi_lo + dpsi*(i+0.5); phi = j*dphi, up to 3*pi
+    double psi_lo, dpsi, dphi;
+    std::vector<float> y;//(w, w', u, u') per sample, by row; NAN past what was integrated
+    std::vector<double> end, end_slope;//polar angle where each row ends, and its derivative in psi0
+    std::vector<char> fate;//ESCAPING or CAPTURED; NEAR_CRITICAL for a row still going at the last sample
+    double max_jump;//end angles of neighbouring rows further apart than this are not interpolated
+    //rows spread over [lo, hi], where the rays of the frame start
+    RayTable(double r, double gm, double rs, double lo=0, double hi=M_PI, int n=4096, int per_pi=64) {
+        r0 = r;
+        GM = gm;
+        sch_rad = rs;
+        rows = n;
+        psi_lo = lo;
+        dpsi = (hi-lo)/n;
+        cols = 3*per_pi + 1;
+        dphi = M_PI/per_pi;
+        max_jump = 0.05;
+        y.assign(size_t(rows)*cols*4, NAN);
+        end.assign(rows, INFINITY);
+        end_slope.assign(rows, 0);
+        fate.assign(rows, NEAR_CRITICAL);
+        const double h = dphi/2;//two RK4 steps per sample
+        for(int i=0; i<rows; ++i) {
+            OrbitVariation f(r0, GM, sch_rad, psi_lo + dpsi*(i+0.5));
+            double v[4];
+            f.start(v);
+            int past = 0;
+            for(int j=0; j<cols && past < 3; ++j) {
+                for(int q=0; q<4; ++q) y[(size_t(i)*cols + j)*4 + q] = v[q];
+                if(fate[i] != NEAR_CRITICAL) ++past;
+                for(int sub=0; sub<2; ++sub) {
+                    double a[4] = {v[0], v[1], v[2], v[3]};
+                    f.step(v, h);
+                    if(fate[i] == NEAR_CRITICAL && (v[0] <= 0 || v[0] >= 1)) {
+                        double level = v[0] <= 0 ? 0 : 1;
+                        double lo = 0, hi = 1;
+                        for(int k=0; k<48; ++k) {
+                            double mid = (lo+hi)/2;
+                            if((hermite(a[0], a[1], v[0], v[1], h, mid) - level)*(a[0] - level) > 0) lo = mid; else hi = mid;
+                        }
+                        double t = (lo+hi)/2;
+                        end[i] = (2*j + sub + t)*h;
+                        end_slope[i] = -hermite(a[2], a[3], v[2], v[3], h, t)/hermite_slope(a[0], a[1], v[0], v[1], h, t);
+                        fate[i] = level ? CAPTURED : ESCAPING;
+                    }
+                }
+            }
+        }
+    }
+    //psi0 of a ray leaving r0 along dir, pos being where it starts
+    static double angle_of(vec3 pos, vec3 dir) {
+        return atan2(abs(crossprod(pos, dir)), dotprod(pos, dir));
+    }
+    //the rows i, i+1 around psi0 and where it lies between them; false if they do not agree on the ray
+    bool bracket(double psi0, int &i, double &t) const {
+        double x = (psi0-psi_lo)/dpsi - 0.5;
+        i = x;
+        i = i < 0 ? 0 : (i < rows-2 ? i : rows-2);
+        t = x - i;
+        return fate[i] == fate[i+1] && fate[i] != NEAR_CRITICAL && fabs(end[i+1] - end[i]) < max_jump;
+    }
+    //how the ray at psi0 ends, and at which polar angle; NEAR_CRITICAL if the table cannot say
+    enum ray_fate fate_of(double psi0, double &phi_end) const {
+        int i;
+        double t;
+        if(!bracket(psi0, i, t)) return NEAR_CRITICAL;
+        phi_end = hermite(end[i], end_slope[i], end[i+1], end_slope[i+1], dpsi, t);
+        return (enum ray_fate)fate[i];
+    }
+    //w and dw/dphi of the ray at psi0 at polar angle phi; false past what the table holds
+    bool radius_at(double psi0, double phi, double &w, double &dw) const {
+        int i;
+        double t;
+        double x = phi/dphi;
+        int j = x;
+        if(!bracket(psi0, i, t) || phi < 0 || j >= cols-1) return false;
+        double s = x - j, wr[2], ur[2], dr[2];
+        for(int k=0; k<2; ++k) {
+            const float* a = &y[(size_t(i+k)*cols + j)*4];
+            const float* b = a + 4;
+            if(b[0] != b[0]) return false;
+            wr[k] = hermite(a[0], a[1], b[0], b[1], dphi, s);
+            dr[k] = hermite_slope(a[0], a[1], b[0], b[1], dphi, s);
+            ur[k] = hermite(a[2], a[3], b[2], b[3], dphi, s);
+        }
+        w = hermite(wr[0], ur[0], wr[1], ur[1], dpsi, t);
+        dw = dr[0]*(1-t) + dr[1]*t;
+        return true;
+    }
+};
+
+#endif
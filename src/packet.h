@@ -0,0 +1,110 @@
+#ifndef _PACKET_H
+#define _PACKET_H
+
+#include <cmath>
+#include <cstring>
+
+//Stepper packets: the stepper's arithmetic for packet_width rays at once, in structure-of-arrays layout.
+//The kernel (packet_kernel.h) is compiled once per instruction set and the widest one the cpu has is picked at runtime;
+//everything that is rare per step (disk hits, capture rechecks, escapes) is left to scalar code via per-lane events.
+
+const int packet_width = 8;
+
+enum {PACKET_CROSS=1, PACKET_HOLE=2, PACKET_OUT=4};
+
+struct PacketParams {
+    double sch_rad, sqrad, GM;
+    double min_tick, max_factor;
+    int tick_pow;//integral dyn_tick_power
+    double escape_rad;//outbound lanes beyond this are flagged PACKET_OUT
+};
+
+struct PacketLanes {
+    alignas(64) double x[packet_width];
+    alignas(64) double y[packet_width];
+    alignas(64) double z[packet_width];
+    alignas(64) double vx[packet_width];
+    alignas(64) double vy[packet_width];
+    alignas(64) double vz[packet_width];
+    //after a step
+    alignas(64) double nx[packet_width];
+    alignas(64) double ny[packet_width];
+    alignas(64) double nz[packet_width];
+    alignas(64) double nvx[packet_width];
+    alignas(64) double nvy[packet_width];
+    alignas(64) double nvz[packet_width];
+    alignas(64) long long events[packet_width];
+    PacketLanes() {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+typedef void (*packet_step_fn)(PacketLanes&, const PacketParams&);
+
+namespace packet_scalar {
+#define PACKET_VW 1
+#include "packet_kernel.h"
+#undef PACKET_VW
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PACKET_X86
+#include <immintrin.h>
+
+//no fma contraction: lanes have to round exactly like the scalar stepper
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+namespace packet_avx2 {
+#define PACKET_VW 4
+#include "packet_kernel.h"
+#undef PACKET_VW
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+namespace packet_avx512 {
+#define PACKET_VW 8
+#include "packet_kernel.h"
+#undef PACKET_VW
+}
+#pragma GCC pop_options
+#endif
+
+enum packet_isa {PACKET_OFF, PACKET_SCALAR, PACKET_AVX2, PACKET_AVX512, PACKET_AUTO};
+
+const char* packet_isa_name(enum packet_isa isa) {
+    switch(isa) {
+        case PACKET_SCALAR: return "scalar";
+        case PACKET_AVX2: return "avx2";
+        case PACKET_AVX512: return "avx512";
+        case PACKET_AUTO: return "auto";
+        default: return "off";
+    }
+}
+
+//widest supported set not above the requested one (auto: widest there is)
+enum packet_isa packet_resolve(enum packet_isa isa) {
+    if(isa == PACKET_OFF || isa == PACKET_SCALAR) return isa;
+#ifdef PACKET_X86
+    __builtin_cpu_init();
+    if((isa == PACKET_AUTO || isa == PACKET_AVX512) && __builtin_cpu_supports("avx512f")) return PACKET_AVX512;
+    if(__builtin_cpu_supports("avx2")) return PACKET_AVX2;
+#endif
+    return PACKET_SCALAR;
+}
+
+packet_step_fn packet_kernel(enum packet_isa isa) {
+    switch(isa) {
+#ifdef PACKET_X86
+        case PACKET_AVX512: return packet_avx512::packet_step;
+        case PACKET_AVX2: return packet_avx2::packet_step;
+#endif
+        case PACKET_SCALAR: return packet_scalar::packet_step;
+        default: return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,62 @@
+//one stepper step for all lanes of a packet, PACKET_VW lanes per vector.
+//no include guard: packet.h includes this once per instruction set, each time in its own namespace.
+//the arithmetic is the stepper's in trace_pixel operation for operation, so lanes come out bit-identical to it.
+
+typedef double vd __attribute__((vector_size(8*PACKET_VW)));
+typedef long long vl __attribute__((vector_size(8*PACKET_VW)));
+
+static inline vd vsqrt(vd a) {
+#if PACKET_VW == 8
+    return (vd)_mm512_sqrt_pd((__m512d)a);
+#elif PACKET_VW == 4
+    return (vd)_mm256_sqrt_pd((__m256d)a);
+#else
+    for(int i=0; i<PACKET_VW; ++i) a[i] = sqrt(a[i]);
+    return a;
+#endif
+}
+
+static inline vd vload(const double* p) {
+    return *(const vd*)p;
+}
+
+static inline void vstore(double* p, vd a) {
+    *(vd*)p = a;
+}
+
+void packet_step(PacketLanes &L, const PacketParams &P) {
+    const vd zero = {}, one = zero + 1, two = zero + 2.0;
+    const vd max_factor = zero + P.max_factor, sch_rad = zero + P.sch_rad, escape_rad = zero + P.escape_rad;
+    for(int o=0; o<packet_width; o+=PACKET_VW) {
+        vd x = vload(L.x+o), y = vload(L.y+o), z = vload(L.z+o);
+        vd vx = vload(L.vx+o), vy = vload(L.vy+o), vz = vload(L.vz+o);
+        vd d = x*x + y*y + z*z;
+        vd rad = vsqrt(d);
+        vd q = rad/sch_rad;
+        q = q < max_factor ? q : max_factor;
+        vd f = one;
+        for(int i=0; i<P.tick_pow; ++i) f *= q;
+        vd dt = P.min_tick * f;
+        //move
+        vd nx = x + vx*dt, ny = y + vy*dt, nz = z + vz*dt;
+        vd nd = nx*nx + ny*ny + nz*nz;
+        vd nrad = vsqrt(nd);
+        vd cx = nx - x, cy = ny - y, cz = nz - z;
+        vl cross = nz*z <= zero;
+        vl hole = (nrad < sch_rad) | (vsqrt(cx*cx + cy*cy + cz*cz) > vsqrt(nd - P.sqrad) + vsqrt(d - P.sqrad));
+        //bend
+        vd k = dt*P.GM/(-rad*rad);
+        vd gx = nx/nrad*k, gy = ny/nrad*k, gz = nz/nrad*k;
+        vd hx = vx + gx/two, hy = vy + gy/two, hz = vz + gz/two;
+        vd s = (gx*hx + gy*hy + gz*hz)/(hx*hx + hy*hy + hz*hz);
+        vx = vx + (gx - hx*s);
+        vy = vy + (gy - hy*s);
+        vz = vz + (gz - hz*s);
+        vd vn = vsqrt(vx*vx + vy*vy + vz*vz);
+        vx = vx/vn; vy = vy/vn; vz = vz/vn;
+        vl out = (vx*nx + vy*ny + vz*nz > zero) & (nrad > escape_rad);
+        vstore(L.nx+o, nx); vstore(L.ny+o, ny); vstore(L.nz+o, nz);
+        vstore(L.nvx+o, vx); vstore(L.nvy+o, vy); vstore(L.nvz+o, vz);
+        *(vl*)(L.events+o) = (cross & (long long)PACKET_CROSS) | (hole & (long long)PACKET_HOLE) | (out & (long long)PACKET_OUT);
+    }
+}
@@ -5,22 +5,42 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef TEXSIM
+#include "texsim.h"
+#endif
 
 const int wvlen_step = 5;
-const int max_wvlen = 200;//1000 nm
-
-struct Spectre;
+//spectra are sampled on a global grid of wvlen_step nm; each spectre type stores only its own band of it
+const int cie_wvlen_first=360, cie_wvlen_last=830;//range of the CIE tables, everything outside is invisible
+const int texture_wvlen_first=380, texture_wvlen_last=700;//range of the spectral textures (last one excluded)
 
-struct IntTable{
-    double x[max_wvlen];    
-    double y[max_wvlen];    
-    double z[max_wvlen];    
-    IntTable(const char* fname) {
+template<int First, int Last, int Step=wvlen_step> struct IntTableT{
+    static const int first = First/Step;
+    static const int bins = (Last-First)/Step + 1;
+    double x[bins];    
+    double y[bins];    
+    double z[bins];    
+    IntTableT(const char* fname) {
+        for(int i=0; i<bins; ++i) {
+            x[i] = y[i] = z[i] = 0;
+        }
         FILE* f = fopen(fname, "r");
         double cx, cy, cz;
         int wlen, i;
         while(4 == fscanf(f, "%d %lf %lf %lf\n", &wlen ,&cx, &cy, &cz)) {
-            i=wlen/wvlen_step;
+            i=wlen/Step - first;
+            if(i<0 || i>=bins) continue;
             x[i] = cx;
             y[i] = cy;
             z[i] = cz;
@@ -29,167 +49,725 @@ struct IntTable{
     }
 };
 
-struct Spectre {
+png::rgb_pixel xyz_to_rgb(double x, double y, double z, double norm_mul) {
+    double r,g,b;
+    r= x*3.2404542 - y*1.5371385 - z*0.4985314;
+    g=-x*0.9692660 + y*1.8760108 + z*0.0415560;
+    b= x*0.0556434 - y*0.2040259 + z*1.0572252;
+    int rr, gg, bb;
+    rr = r*norm_mul;
+    gg = g*norm_mul;
+    bb = b*norm_mul;
+    rr = (rr>255)?255:rr;
+    rr = (rr<0)?0:rr;
+    gg = (gg>255)?255:gg;
+    gg = (gg<0)?0:gg;
+    bb = (bb>255)?255:bb;
+    bb = (bb<0)?0:bb;
+    return png::rgb_pixel(rr, gg, bb);
+}
+
+//spectre sampled at First, First+Step, ..., Last nm; zero everywhere else
+template<int First, int Last, int Step=wvlen_step> struct SpectreT {
     public:
-        double values[max_wvlen];
-        Spectre shifted(double factor){
-            Spectre newspec;
+        static const int first = First/Step;//index of values[0] on the global grid
+        static const int bins = (Last-First)/Step + 1;
+        double values[bins];
+
+        //resample into (possibly different) band S, stretching wavelengths by factor
+        template<typename S> S shifted(double factor) const {
+            S newspec;
             double newwl;
-            for(int i=0; i<max_wvlen; ++i) {
-                newwl = i*wvlen_step/factor;//reverse
+            for(int i=0; i<S::bins; ++i) {
+                newwl = (i+S::first)*Step/factor;//reverse
                 newspec.values[i] = this->getwl(newwl);
             }
             return newspec;
         }
 
-        Spectre(){
-            for(int i=0; i<max_wvlen; ++i) {
+        SpectreT(){
+            for(int i=0; i<bins; ++i) {
                 values[i] = 0;
             }
         }
         
-        double getwl(double wl){
-            double x = wl/wvlen_step;
-            if(x > max_wvlen || x < 0) return 0;
+        //value at global grid index i
+        double at(int i) const {
+            i -= first;
+            return (i<0 || i>=bins) ? 0 : values[i];
+        }
+
+        double getwl(double wl) const {
+            double x = wl/Step;
+            if(x >= first+bins || x <= first-1) return 0;
             int left = floor(x);
             int right = ceil(x);
             double xx = x-left;  
-            return values[left]*(1-xx) + values[right]*xx;
+            return at(left)*(1-xx) + at(right)*xx;
         }
 
-        Spectre& operator*=(double mul){
-            for(int i=0; i<max_wvlen; ++i) {
+        SpectreT& operator*=(double mul){
+            for(int i=0; i<bins; ++i) {
                 values[i] *= mul;
             }
             return *this;
         }
         
-        friend Spectre operator*(const Spectre& s, double mul);
-
-        Spectre& operator+=(const Spectre& s){
-            for(int i=0; i<max_wvlen; ++i) {
+        SpectreT& operator+=(const SpectreT& s){
+            for(int i=0; i<bins; ++i) {
                 values[i] += s.values[i];
             }
             return *this;
         }
 
-        friend Spectre operator+(const Spectre&, const Spectre);
-        
-        png::rgb_pixel to_rgb(const IntTable &t, double norm_mul=0.06) {
-            double x,y,z,r,g,b;
+        //fused forms of the usual shading expressions: one pass over the bins, no temporary spectres.
+        //each adds exactly what the spelled-out expression would, bin by bin.
+
+        //*this += s*w
+        SpectreT& add_scaled(const SpectreT& s, double w){
+            for(int i=0; i<bins; ++i) {
+                values[i] += s.values[i]*w;
+            }
+            return *this;
+        }
+
+        //*this += src.shifted<SpectreT>(factor)*w
+        template<typename S> SpectreT& add_shifted(const S& src, double factor, double w){
+            for(int i=0; i<bins; ++i) {
+                values[i] += src.getwl((i+first)*Step/factor)*w;
+            }
+            return *this;
+        }
+
+        //*this += (a*wa + b*wb + c*wc + d*wd)*w, i.e. a bilinear blend of four texels
+        SpectreT& add_bilinear(const SpectreT& a, double wa, const SpectreT& b, double wb,
+                const SpectreT& c, double wc, const SpectreT& d, double wd, double w){
+            for(int i=0; i<bins; ++i) {
+                values[i] += (a.values[i]*wa + b.values[i]*wb + c.values[i]*wc + d.values[i]*wd)*w;
+            }
+            return *this;
+        }
+
+        png::rgb_pixel to_rgb(const IntTableT<First,Last,Step> &t, double norm_mul=0.06) const {
+            double x,y,z;
             x=y=z=0;
-            for(int i=0;i<max_wvlen;++i){
+            for(int i=0;i<bins;++i){
                 x += values[i] * t.x[i];
                 y += values[i] * t.y[i];
                 z += values[i] * t.z[i];
             }
-            r= x*3.2404542 - y*1.5371385 - z*0.4985314;
-            g=-x*0.9692660 + y*1.8760108 + z*0.0415560;
-            b= x*0.0556434 - y*0.2040259 + z*1.0572252;
-            int rr, gg, bb;
-            rr = r*norm_mul;
-            gg = g*norm_mul;
-            bb = b*norm_mul;
-            rr = (rr>255)?255:rr;
-            rr = (rr<0)?0:rr;
-            gg = (gg>255)?255:gg;
-            gg = (gg<0)?0:gg;
-            bb = (bb>255)?255:bb;
-            bb = (bb<0)?0:bb;
-            return png::rgb_pixel(rr, gg, bb);
+            return xyz_to_rgb(x, y, z, norm_mul);
         }
 };
 
-Spectre operator*(const Spectre& self, double mul) {
-    Spectre result=self;
+template<int F, int L, int S> SpectreT<F,L,S> operator*(const SpectreT<F,L,S>& self, double mul) {
+    SpectreT<F,L,S> result=self;
     result*=mul;
     return result;
 }
 
-Spectre operator+(const Spectre& self, const Spectre& other) {
-    Spectre result=self;
+template<int F, int L, int S> SpectreT<F,L,S> operator+(const SpectreT<F,L,S>& self, const SpectreT<F,L,S>& other) {
+    SpectreT<F,L,S> result=self;
     result+=other;
     return result;
 }
 
-class SpectralImage{
+//what ends up in the framebuffer: everything the CIE tables can see
+typedef SpectreT<cie_wvlen_first, cie_wvlen_last> Spectre;
+typedef IntTableT<cie_wvlen_first, cie_wvlen_last> IntTable;
+//what the textures hold, before any shifting
+typedef SpectreT<texture_wvlen_first, texture_wvlen_last-wvlen_step> TexSpectre;
+
+//an already integrated colour; stands in for Spectre in the framebuffer when shading through a ShiftResponse
+struct XYZ {
+    double x, y, z;
+    XYZ(double xx=0, double yy=0, double zz=0) {
+        x = xx; y = yy; z = zz;
+    }
+    XYZ& operator+=(const XYZ& o) {
+        x += o.x; y += o.y; z += o.z;
+        return *this;
+    }
+    XYZ& operator*=(double mul) {
+        x *= mul; y *= mul; z *= mul;
+        return *this;
+    }
+    XYZ& add_scaled(const XYZ& o, double w) {
+        x += o.x*w; y += o.y*w; z += o.z*w;
+        return *this;
+    }
+    XYZ& add_bilinear(const XYZ& a, double wa, const XYZ& b, double wb,
+            const XYZ& c, double wc, const XYZ& d, double wd, double w) {
+        x += (a.x*wa + b.x*wb + c.x*wc + d.x*wd)*w;
+        y += (a.y*wa + b.y*wb + c.y*wc + d.y*wd)*w;
+        z += (a.z*wa + b.z*wb + c.z*wc + d.z*wd)*w;
+        return *this;
+    }
+    template<typename T> png::rgb_pixel to_rgb(const T &, double norm_mul=0.06) const {
+        return xyz_to_rgb(x, y, z, norm_mul);
+    }
+};
+
+XYZ operator*(const XYZ& self, double mul) {
+    XYZ result=self;
+    result*=mul;
+    return result;
+}
+
+//CIE response of a Src spectre after shifting by factor f, i.e. to_rgb(src.shifted<Dst>(f)) up to the rgb step.
+//both shifting and integration are linear in the spectre, so for every f this is a 3 x Src::bins matrix;
+//the matrices are tabulated on a uniform grid in ln(f) and interpolated linearly between neighbours.
+//outside [f_min, f_max] no part of the source band lands in the table band, so the response is exactly zero.
+//max_error bounds the error of X, Y or Z for any non-negative spectre with values <= 1: per row it is the
+//larger of the summed positive and summed negative deviations of the interpolated matrix from the exact one.
+//it is checked at the midpoints between levels, where linear interpolation is at its worst, and given
+//relative to the Y response of a flat unit spectre at f=1; scale by the texel range (255) for absolute values.
+template<typename Src, typename Tbl> class ShiftResponseT {
     private:
-        Spectre *** pixels;
-        unsigned x_res;
-        unsigned y_res;
-        void allocate(int xres, int yres) {
-            x_res = xres;
-            y_res = yres;
-            pixels = static_cast<Spectre***>(malloc(x_res * sizeof(Spectre**)));//allocate row pointers
-            for(int x=0; x<x_res; ++x) {//allocate rows
-                pixels[x] = static_cast<Spectre**>(malloc(y_res * sizeof(Spectre*)));
-                for(int y=0; y<y_res; ++y) {//allocate elements                
-                    pixels[x][y] = new Spectre;
+        int levels;
+        double lnf_min, lnf_step;
+        std::vector<double> m;//levels x 3 x Src::bins
+        double max_err;
+        void exact(const Tbl& t, double f, double* out) const {//3 x Src::bins
+            for(int j=0; j<3*Src::bins; ++j) out[j] = 0;
+            for(int i=0; i<Tbl::bins; ++i) {
+                double x = (i+Tbl::first)*wvlen_step/f/wvlen_step;//same sampling as SpectreT::getwl
+                if(x >= Src::first+Src::bins || x <= Src::first-1) continue;
+                int left = floor(x);
+                int right = ceil(x);
+                double xx = x-left;
+                const double tc[3] = {t.x[i], t.y[i], t.z[i]};
+                for(int c=0; c<3; ++c) {
+                    if(left >= Src::first) out[c*Src::bins + left-Src::first] += tc[c]*(1-xx);
+                    if(right < Src::first+Src::bins) out[c*Src::bins + right-Src::first] += tc[c]*xx;
                 }
             }
         }
     public:
-        SpectralImage() {
-            x_res = 0;
-            y_res = 0;
+        double f_min, f_max;
+        ShiftResponseT(const Tbl& t, int nlevels=4096) {
+            levels = nlevels<2 ? 2 : nlevels;
+            f_min = double(Tbl::first*wvlen_step)/((Src::first+Src::bins)*wvlen_step);
+            f_max = double((Tbl::first+Tbl::bins-1)*wvlen_step)/((Src::first-1)*wvlen_step);
+            lnf_min = log(f_min);
+            lnf_step = (log(f_max) - lnf_min)/(levels-1);
+            const int n = 3*Src::bins;
+            m.resize(size_t(levels)*n);
+            for(int k=0; k<levels; ++k) {
+                exact(t, exp(lnf_min + k*lnf_step), &m[size_t(k)*n]);
+            }
+            std::vector<double> mid(n), unit(n);
+            exact(t, 1, &unit[0]);
+            double unit_y = 0;
+            for(int j=0; j<Src::bins; ++j) unit_y += unit[Src::bins + j];
+            max_err = 0;
+            for(int k=0; k+1<levels; ++k) {
+                exact(t, exp(lnf_min + (k+0.5)*lnf_step), &mid[0]);
+                for(int c=0; c<3; ++c) {
+                    double over = 0, under = 0;
+                    for(int j=0; j<Src::bins; ++j) {
+                        int idx = c*Src::bins + j;
+                        double d = 0.5*(m[size_t(k)*n + idx] + m[size_t(k+1)*n + idx]) - mid[idx];
+                        if(d > 0) over += d; else under -= d;
+                    }
+                    double err = over > under ? over : under;
+                    max_err = err > max_err ? err : max_err;
+                }
+            }
+            max_err /= unit_y;
+        }
+        double max_error() const {return max_err;}
+        XYZ response(const Src& s, double f) const {
+            if(!(f > f_min && f < f_max)) return XYZ();
+            double pos = (log(f) - lnf_min)/lnf_step;
+            int k = static_cast<int>(pos);
+            if(k > levels-2) k = levels-2;
+            double w = pos - k;
+            const int n = 3*Src::bins;
+            const double* a = &m[size_t(k)*n];
+            const double* b = a + n;
+            double acc[3] = {0, 0, 0};
+            for(int c=0; c<3; ++c) {
+                for(int j=0; j<Src::bins; ++j) {
+                    int idx = c*Src::bins + j;
+                    acc[c] += (a[idx] + w*(b[idx]-a[idx])) * s.values[j];
+                }
+            }
+            return XYZ(acc[0], acc[1], acc[2]);
+        }
+};
+
+typedef ShiftResponseT<TexSpectre, IntTable> ShiftResponse;
 
+//on-disk quantized spectral texture: this header, then the texels' values exactly as QuantizedTextureT keeps them
+//(in layout order, padding included), starting at data_offset
+struct SpectralCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t wvlen_first;//band of the stored texels
+    int32_t wvlen_last;
+    int32_t wvlen_step;
+    uint32_t height;
+    uint32_t width;
+    uint32_t value_bytes;//per stored value
+    uint32_t layout;//enum texel_layout of the stored texels
+    double scale;//texel = stored value*scale
+    uint64_t source_stamp;//hash of the source PNGs' names, sizes and mtimes
+    uint64_t data_offset;
+};
+const char spectral_cache_magic[8] = {'G','R','T','S','P','E','C','\0'};
+const uint32_t spectral_cache_version = 3;
+const uint64_t spectral_cache_data_offset = 4096;//page-aligned texels
+
+//fnv-1a over the name and stat data of every source plane, so touching, replacing or pointing at other PNGs invalidates the cache
+uint64_t spectral_source_stamp(int start, int end, const char* format, bool &complete) {
+    uint64_t h = 14695981039346656037ULL;
+    char filename[2048];
+    struct stat st;
+    complete = true;
+    for(int wl=start; wl<end; wl+=wvlen_step) {
+        sprintf(filename, format, wl);
+        if(stat(filename, &st)) {
+            complete = false;
+            continue;
         }
-        SpectralImage(int yres, int xres) {
-            allocate(xres, yres);
+        for(const char* c=filename; *c; ++c) {
+            h = (h ^ static_cast<unsigned char>(*c)) * 1099511628211ULL;
         }
-        SpectralImage(int start, int end, const char* format) {
-            if(start%wvlen_step || end%wvlen_step) {
-                throw "endpoints do not divide!"    ;
+        uint64_t fields[4] = {uint64_t(wl), uint64_t(st.st_size), uint64_t(st.st_mtim.tv_sec), uint64_t(st.st_mtim.tv_nsec)};
+        const unsigned char* b = reinterpret_cast<const unsigned char*>(fields);
+        for(unsigned i=0; i<sizeof(fields); ++i) {
+            h = (h ^ b[i]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+//Where texel (x,y) of a texture lives in its storage. Rows is plain row-major. Tiles keeps 8x8 blocks together
+//(64 one-byte TexSpectre texels of 64 bytes each make a 4 KB page), so a bilinear footprint and the nearby hits of
+//neighbouring rays stay within a page or two. Morton orders 64x64 blocks along a Z curve, which makes every aligned
+//2^k x 2^k square up to 64x64 contiguous. Blocked layouts are padded up to whole blocks.
+enum texel_layout {LAYOUT_ROWS, LAYOUT_TILES, LAYOUT_MORTON};
+
+const char* texel_layout_name(enum texel_layout l) {
+    switch(l) {
+        case LAYOUT_TILES: return "tiles";
+        case LAYOUT_MORTON: return "morton";
+        default: return "rows";
+    }
+}
+
+struct TexelLayout {
+    enum texel_layout kind;
+    unsigned block_bits;//log2 of the block side, 0 for rows
+    size_t stride;//blocks per row of blocks (texels per row for rows)
+    size_t count;//texels to allocate, padding included
+    TexelLayout(unsigned height=0, unsigned width=0, enum texel_layout k=LAYOUT_ROWS) {
+        kind = k;
+        block_bits = k == LAYOUT_TILES ? 3 : (k == LAYOUT_MORTON ? 6 : 0);
+        size_t side = size_t(1)<<block_bits;
+        stride = (width + side-1)>>block_bits;
+        count = ((height + side-1)>>block_bits) * stride << (2*block_bits);
+    }
+    //bits of v (< 2^16) moved to the even positions
+    static unsigned spread(unsigned v) {
+        v = (v | (v<<8)) & 0x00ff00ff;
+        v = (v | (v<<4)) & 0x0f0f0f0f;
+        v = (v | (v<<2)) & 0x33333333;
+        v = (v | (v<<1)) & 0x55555555;
+        return v;
+    }
+    size_t index(unsigned x, unsigned y) const {
+        if(kind == LAYOUT_ROWS) return size_t(x)*stride + y;
+        unsigned m = (1u<<block_bits) - 1;
+        size_t block = ((x>>block_bits)*stride + (y>>block_bits)) << (2*block_bits);
+        if(kind == LAYOUT_TILES) return block + ((x&m)<<block_bits) + (y&m);
+        return block + (spread(x&m)<<1 | spread(y&m));
+    }
+};
+
+template<typename S> class SpectralImageT{
+    public:
+        typedef S texel_type;
+    private:
+        S * pixels;//one contiguous block, x_res rows of y_res pixels placed by layout
+        unsigned x_res;
+        unsigned y_res;
+        TexelLayout layout;
+        static const size_t alignment = 64;//cache line
+        void allocate(int xres, int yres, enum texel_layout l=LAYOUT_ROWS) {
+            x_res = xres;
+            y_res = yres;
+            layout = TexelLayout(x_res, y_res, l);
+            size_t count = layout.count;
+            if(!count) {
+                pixels = NULL;
+                return;
+            }
+            size_t bytes = (count * sizeof(S) + alignment - 1) / alignment * alignment;
+            pixels = static_cast<S*>(aligned_alloc(alignment, bytes));
+            if(!pixels) {
+                throw std::bad_alloc();
             }
-            int i0 = start/wvlen_step;
+            std::uninitialized_fill_n(pixels, count, S());
+        }
+        void release() {
+            free(pixels);//spectra are trivially destructible
+            pixels = NULL;
+            x_res = y_res = 0;
+            layout = TexelLayout();
+        }
+        void swap(SpectralImageT& other) {
+            std::swap(pixels, other.pixels);
+            std::swap(x_res, other.x_res);
+            std::swap(y_res, other.y_res);
+            std::swap(layout, other.layout);
+        }
+        void load_png(int start, int end, const char* format) {
+            int i0 = start/wvlen_step - S::first;
             int il = (end-start)/wvlen_step;
 
             png::image<png::gray_pixel> imgs[il];
             char filename[2048];
             for(int i=0; i<il; ++i){
-                sprintf(filename, format, (i+i0)*wvlen_step);
+                sprintf(filename, format, start + i*wvlen_step);
                 imgs[i] = png::image<png::gray_pixel>(filename);
             }
             allocate(imgs[0].get_height(),imgs[0].get_width());//allocate space
             for(int x=0; x<x_res; ++x){
                 for(int y=0; y<y_res; ++y){
+                    S& px = getpx(x,y);
                     for(int i=0; i<il; ++i) {//fill spectre
-                        pixels[x][y]->values[i0+i] = imgs[i][x][y];
+                        px.values[i0+i] = imgs[i][x][y];
                     }
                 }
             }
         }
+    public:
+        SpectralImageT() {
+            pixels = NULL;
+            x_res = 0;
+            y_res = 0;
+        }
+        SpectralImageT(int yres, int xres, enum texel_layout l=LAYOUT_ROWS) {
+            allocate(xres, yres, l);
+        }
+        SpectralImageT(int start, int end, const char* format) {
+            if(start%wvlen_step || end%wvlen_step) {
+                throw "endpoints do not divide!"    ;
+            }
+            if(start/wvlen_step < S::first || end/wvlen_step > S::first+S::bins) {
+                throw "wavelength range does not fit the spectre!";
+            }
+            load_png(start, end, format);
+        }
+        SpectralImageT(const SpectralImageT& other) {
+            allocate(other.x_res, other.y_res, other.layout.kind);
+            if(pixels) {
+                memcpy(pixels, other.pixels, layout.count * sizeof(S));
+            }
+        }
+        SpectralImageT(SpectralImageT&& other) {
+            pixels = other.pixels;
+            x_res = other.x_res;
+            y_res = other.y_res;
+            layout = other.layout;
+            other.pixels = NULL;
+            other.x_res = other.y_res = 0;
+            other.layout = TexelLayout();
+        }
+        SpectralImageT& operator=(SpectralImageT other) {//copy-and-swap, moves when given an rvalue
+            swap(other);
+            return *this;
+        }
+        ~SpectralImageT() {
+            release();
+        }
         
         unsigned get_height(){return x_res;}
         unsigned get_width(){return y_res;}
-        /*
-        ~SpectralImage(){
-            if(instances && *instances) {--(*instances); return;}
-            for(int x=0; x<x_res; ++x) {//free rows
-                for(int y=0; y<y_res; ++y) {//free elements                
-                    delete pixels[x][y];
-                }
-                free(pixels[x]);
-            }
-            free(pixels);
-        }*/
+        enum texel_layout get_layout(){return layout.kind;}
+        size_t bytes(){return layout.count*sizeof(S);}
 
-        Spectre& getpx(int x, int y) {
-            Spectre* px = pixels[x][y];
-            return *px;
+        S& getpx(int x, int y) {
+#ifdef TEXSIM
+            texsim.touch(&pixels[layout.index(x,y)], sizeof(S));
+#endif
+            return pixels[layout.index(x,y)];
         }
         
-        png::image<png::rgb_pixel> toRGB(const IntTable &t, double norm_mul=0.06){
+        template<typename T> png::image<png::rgb_pixel> toRGB(const T &t, double norm_mul=0.06){
             png::image<png::rgb_pixel> oi(y_res, x_res);
             for(int x=0;x<x_res;++x){
                 for(int y=0;y<y_res;++y){
-                    oi[x][y] = pixels[x][y]->to_rgb(t, norm_mul);
+                    oi[x][y] = getpx(x,y).to_rgb(t, norm_mul);
                 }
             }
             return oi;
         }
 };
 
+//A spectral texture stored as Q (unsigned char or unsigned short) per bin, with one scale for the whole texture:
+//texel = q*scale. The sources are 8-bit planes, so with unsigned char and scale 1 this is lossless at 1/8 of the size
+//of doubles. Texels are dequantized where they are sampled (getpx, add_texel, add_bilinear) and never stored widened.
+//The values either live in memory or come straight from a mapped cache file (see SpectralCacheHeader), which copies
+//share and which is unmapped with the last of them.
+template<typename S, typename Q> class QuantizedTextureT {
+    private:
+        std::vector<Q> owned;//the values, unless they are mapped
+        std::shared_ptr<void> mapping;//the cache file they are mapped from, if any
+        Q* q;//x_res rows of y_res texels of S::bins values, placed by layout
+        unsigned x_res;
+        unsigned y_res;
+        TexelLayout layout;
+        double scale;
+        void allocate(unsigned height, unsigned width, double sc, enum texel_layout l) {
+            x_res = height;
+            y_res = width;
+            layout = TexelLayout(x_res, y_res, l);
+            scale = sc;
+            owned.assign(layout.count*S::bins, 0);
+            mapping.reset();
+            q = owned.data();
+        }
+        //straight from the 8-bit planes, one at a time: lossless with scale 1
+        void load_png(int start, int end, const char* format, enum texel_layout l) {
+            if(start%wvlen_step || end%wvlen_step) {
+                throw "endpoints do not divide!";
+            }
+            if(start/wvlen_step < S::first || end/wvlen_step > S::first+S::bins) {
+                throw "wavelength range does not fit the spectre!";
+            }
+            int i0 = start/wvlen_step - S::first;
+            int il = (end-start)/wvlen_step;
+            char filename[2048];
+            for(int i=0; i<il; ++i) {
+                sprintf(filename, format, start + i*wvlen_step);
+                png::image<png::gray_pixel> img(filename);
+                if(!i) {
+                    allocate(img.get_height(), img.get_width(), 1, l);
+                } else if(img.get_height() != x_res || img.get_width() != y_res) {
+                    throw "texture planes differ in size!";
+                }
+                for(unsigned x=0; x<x_res; ++x) {
+                    for(unsigned y=0; y<y_res; ++y) {
+                        q[layout.index(x,y)*S::bins + i0+i] = img[x][y];
+                    }
+                }
+            }
+        }
+        static void fill_header(SpectralCacheHeader &hdr, unsigned height, unsigned width, enum texel_layout l, double sc, uint64_t stamp) {
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, spectral_cache_magic, sizeof(hdr.magic));
+            hdr.version = spectral_cache_version;
+            hdr.wvlen_first = S::first*wvlen_step;
+            hdr.wvlen_last = (S::first+S::bins-1)*wvlen_step;
+            hdr.wvlen_step = wvlen_step;
+            hdr.height = height;
+            hdr.width = width;
+            hdr.value_bytes = sizeof(Q);
+            hdr.layout = l;
+            hdr.scale = sc;
+            hdr.source_stamp = stamp;
+            hdr.data_offset = spectral_cache_data_offset;
+        }
+        //map a cache file, in whatever layout it was saved; stamp==NULL accepts whatever sources it was built from
+        bool map_cache(const char* fname, const uint64_t* stamp) {
+            int fd = open(fname, O_RDONLY);
+            if(fd < 0) return false;
+            SpectralCacheHeader hdr, want;
+            struct stat st;
+            if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fstat(fd, &st) || hdr.layout > LAYOUT_MORTON) {
+                close(fd);
+                return false;
+            }
+            enum texel_layout l = static_cast<enum texel_layout>(hdr.layout);
+            fill_header(want, hdr.height, hdr.width, l, hdr.scale, stamp ? *stamp : hdr.source_stamp);
+            TexelLayout tl(hdr.height, hdr.width, l);
+            size_t len = hdr.data_offset + tl.count*texel_bytes;
+            bool ok = !memcmp(&hdr, &want, sizeof(hdr)) && hdr.height && hdr.width && hdr.scale > 0 && size_t(st.st_size) >= len;
+            void* m = MAP_FAILED;
+            if(ok) {//private and read-only: clean pages stay shared with other renders through the page cache
+                m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if(m == MAP_FAILED) return false;
+            owned = std::vector<Q>();
+            mapping = std::shared_ptr<void>(m, [len](void* p) {munmap(p, len);});
+            q = reinterpret_cast<Q*>(static_cast<char*>(m) + hdr.data_offset);
+            x_res = hdr.height;
+            y_res = hdr.width;
+            layout = tl;
+            scale = hdr.scale;
+            return true;
+        }
+    public:
+        typedef S texel_type;
+        static const size_t texel_bytes = S::bins*sizeof(Q);
+        QuantizedTextureT() {
+            q = NULL;
+            x_res = y_res = 0;
+            scale = 1;
+        }
+        //takes the texels over from src; scale 1 if they are small whole numbers already
+        explicit QuantizedTextureT(SpectralImageT<S> src, enum texel_layout l=LAYOUT_ROWS) {
+            const double qmax = std::numeric_limits<Q>::max();
+            double vmax = 0;
+            bool integral = true;
+            for(unsigned x=0; x<src.get_height(); ++x) {
+                for(unsigned y=0; y<src.get_width(); ++y) {
+                    const S& t = src.getpx(x,y);
+                    for(int i=0; i<S::bins; ++i) {
+                        vmax = t.values[i] > vmax ? t.values[i] : vmax;
+                        integral = integral && t.values[i] == floor(t.values[i]);
+                    }
+                }
+            }
+            allocate(src.get_height(), src.get_width(), (integral && vmax <= qmax) || vmax <= 0 ? 1 : vmax/qmax, l);
+            for(unsigned x=0; x<x_res; ++x) {
+                for(unsigned y=0; y<y_res; ++y) {
+                    set_texel(x, y, src.getpx(x,y));
+                }
+            }
+        }
+        //blank texture to be filled with set_texel, for values up to scale*max(Q)
+        QuantizedTextureT(unsigned height, unsigned width, double sc, enum texel_layout l=LAYOUT_ROWS) {
+            allocate(height, width, sc, l);
+        }
+        //from per-wavelength 8-bit PNG planes
+        QuantizedTextureT(int start, int end, const char* format, enum texel_layout l=LAYOUT_ROWS) {
+            load_png(start, end, format, l);
+        }
+        //same as above, but go through a precompiled texture cache: mapped as it is if it was saved in layout l,
+        //copied into it otherwise, and (re)built from the PNGs and saved if they changed
+        QuantizedTextureT(int start, int end, const char* format, const char* cache_fname, enum texel_layout l=LAYOUT_ROWS) {
+            bool have_sources;
+            uint64_t stamp = spectral_source_stamp(start, end, format, have_sources);
+            if(map_cache(cache_fname, have_sources ? &stamp : NULL)) {
+                if(layout.kind != l) {
+                    *this = laid_out(l);
+                }
+                return;
+            }
+            load_png(start, end, format, l);
+            if(write_cache(cache_fname, stamp)) {
+                map_cache(cache_fname, &stamp);//swap the heap copy for the page cache's
+            }
+        }
+        QuantizedTextureT(const QuantizedTextureT& other)
+                : owned(other.owned), mapping(other.mapping), x_res(other.x_res), y_res(other.y_res), layout(other.layout), scale(other.scale) {
+            q = mapping ? other.q : owned.data();
+        }
+        QuantizedTextureT(QuantizedTextureT&& other) : QuantizedTextureT() {
+            swap(other);
+        }
+        QuantizedTextureT& operator=(QuantizedTextureT other) {//copy-and-swap, moves when given an rvalue
+            swap(other);
+            return *this;
+        }
+        void swap(QuantizedTextureT& other) {//vectors keep their buffers when swapped, so q stays valid
+            std::swap(owned, other.owned);
+            std::swap(mapping, other.mapping);
+            std::swap(q, other.q);
+            std::swap(x_res, other.x_res);
+            std::swap(y_res, other.y_res);
+            std::swap(layout, other.layout);
+            std::swap(scale, other.scale);
+        }
+        //write the values out as a cache file, in their layout; goes through a temporary so concurrent readers never see half a file
+        bool write_cache(const char* fname, uint64_t stamp) {
+            char tmpname[2048];
+            snprintf(tmpname, sizeof(tmpname), "%s.tmp.%d", fname, int(getpid()));
+            FILE* f = fopen(tmpname, "wb");
+            if(!f) return false;
+            SpectralCacheHeader hdr;
+            fill_header(hdr, x_res, y_res, layout.kind, scale, stamp);
+            std::vector<char> pad(hdr.data_offset - sizeof(hdr), 0);
+            bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(&pad[0], pad.size(), 1, f) == 1
+                && fwrite(q, texel_bytes, layout.count, f) == layout.count;
+            ok = !fclose(f) && ok;
+            if(ok && !rename(tmpname, fname)) return true;
+            remove(tmpname);
+            return false;
+        }
+        //copy with the texels placed by layout l
+        QuantizedTextureT laid_out(enum texel_layout l) const {
+            QuantizedTextureT t(x_res, y_res, scale, l);
+            for(unsigned x=0; x<x_res; ++x) {
+                for(unsigned y=0; y<y_res; ++y) {
+                    memcpy(&t.q[t.layout.index(x,y)*S::bins], texel_data(x,y), texel_bytes);
+                }
+            }
+            return t;
+        }
+        //round t to the nearest representable texel; distinct texels may be set from different threads
+        void set_texel(int x, int y, const S& t) {
+            const double qmax = std::numeric_limits<Q>::max();
+            Q* d = &q[layout.index(x,y)*S::bins];
+            const double inv = 1/scale;
+            for(int i=0; i<S::bins; ++i) {
+                double v = t.values[i]*inv + 0.5;//round half up, values are non-negative
+                d[i] = v < 1 ? 0 : (v > qmax ? qmax : static_cast<Q>(v));
+            }
+        }
+        //2x2 box-filtered copy at half the resolution (rounded up; an odd last row or column is averaged with itself)
+        QuantizedTextureT downsampled(enum texel_layout l) const {
+            QuantizedTextureT half((x_res+1)/2, (y_res+1)/2, scale, l);
+            for(unsigned x=0; x<half.x_res; ++x) {
+                for(unsigned y=0; y<half.y_res; ++y) {
+                    unsigned xa = 2*x, xb = 2*x+1 < x_res ? 2*x+1 : 2*x;
+                    unsigned ya = 2*y, yb = 2*y+1 < y_res ? 2*y+1 : 2*y;
+                    S t;
+                    add_bilinear(t, xa, ya, 0.25, xa, yb, 0.25, xb, ya, 0.25, xb, yb, 0.25, 1);
+                    half.set_texel(x, y, t);
+                }
+            }
+            return half;
+        }
+        unsigned get_height(){return x_res;}
+        unsigned get_width(){return y_res;}
+        double get_scale(){return scale;}
+        enum texel_layout get_layout(){return layout.kind;}
+        size_t bytes(){return layout.count*texel_bytes;}
+        const Q* texel_data(int x, int y) const {
+#ifdef TEXSIM
+            texsim.touch(&q[layout.index(x,y)*S::bins], texel_bytes);
+#endif
+            return &q[layout.index(x,y)*S::bins];
+        }
+        S getpx(int x, int y) const {
+            S s;
+            const Q* t = texel_data(x,y);
+            for(int i=0; i<S::bins; ++i) {
+                s.values[i] = t[i]*scale;
+            }
+            return s;
+        }
+        //px += getpx(x,y)*w
+        void add_texel(S &px, int x, int y, double w) const {
+            const Q* t = texel_data(x,y);
+            for(int i=0; i<S::bins; ++i) {
+                px.values[i] += t[i]*scale*w;
+            }
+        }
+        //px += (getpx(xa,ya)*wa + ... + getpx(xd,yd)*wd)*w
+        void add_bilinear(S &px, int xa, int ya, double wa, int xb, int yb, double wb,
+                int xc, int yc, double wc, int xd, int yd, double wd, double w) const {
+            const Q* a = texel_data(xa,ya);
+            const Q* b = texel_data(xb,yb);
+            const Q* c = texel_data(xc,yc);
+            const Q* d = texel_data(xd,yd);
+            for(int i=0; i<S::bins; ++i) {
+                px.values[i] += (a[i]*wa + b[i]*wb + c[i]*wc + d[i]*wd)*scale*w;
+            }
+        }
+};
+
+typedef SpectralImageT<Spectre> SpectralImage;//framebuffer
+typedef SpectralImageT<TexSpectre> SpectralTexture;
+typedef SpectralImageT<XYZ> XYZImage;//framebuffer for fused shading
+typedef QuantizedTextureT<TexSpectre, unsigned char> QuantizedTexture;//disk and star textures
+
 //for testing
 /*
 int main(){
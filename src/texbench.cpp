@@ -0,0 +1,59 @@
+#include "spectral.h"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double ns_per_fetch (bench_clock::time_point from, bench_clock::time_point to, int fetches) {
+    return std::chrono::duration<double, std::nano>(to - from).count()/fetches;
+}
+
+//times a filtered texel fetch added into a pixel, spelled out with Spectre temporaries against the fused
+//add_bilinear / add_shifted calls the shading code uses, over random texels of a ~50 MB array
+int main(int argc, char ** argv) {
+    int fetches = argc>1 && atoi(argv[1])>0 ? atoi(argv[1]) : 2000000;
+    const unsigned n = 1<<16, row = 256;
+    std::vector<Spectre> tex(n);
+    std::vector<TexSpectre> src(n);
+    for(unsigned i=0; i<n; ++i) {
+        for(int j=0; j<Spectre::bins; ++j) tex[i].values[j] = (i*7+j)%255;
+        for(int j=0; j<TexSpectre::bins; ++j) src[i].values[j] = (i*5+j)%255;
+    }
+    Spectre px;
+    double w = 0.3;
+    unsigned k = 1;
+    //the same pseudo-random texel sequence for every variant, a 2x2 footprint on rows of 256 texels
+    auto next = [&]() {k = k*1664525u + 1013904223u; return k%(n-row-2);};
+    bench_clock::time_point t0 = bench_clock::now();
+    for(int r=0; r<fetches; ++r) {
+        unsigned a = next();
+        Spectre b = tex[a]*0.1;
+        b += tex[a+1]*0.2;
+        b += tex[a+row]*0.3;
+        b += tex[a+row+1]*0.4;
+        px += b*w;
+    }
+    bench_clock::time_point t1 = bench_clock::now();
+    for(int r=0; r<fetches; ++r) {
+        unsigned a = next();
+        px.add_bilinear(tex[a], 0.1, tex[a+1], 0.2, tex[a+row], 0.3, tex[a+row+1], 0.4, w);
+    }
+    bench_clock::time_point t2 = bench_clock::now();
+    for(int r=0; r<fetches; ++r) {
+        px += src[next()].shifted<Spectre>(1.1)*w;
+    }
+    bench_clock::time_point t3 = bench_clock::now();
+    for(int r=0; r<fetches; ++r) {
+        px.add_shifted(src[next()], 1.1, w);
+    }
+    bench_clock::time_point t4 = bench_clock::now();
+    cerr<<fetches<<" fetches from "<<n*sizeof(Spectre)/1048576<<" MB, ns per fetch (temporaries -> fused):"<<endl;
+    cerr<<"  bilinear + scale + add: "<<ns_per_fetch(t0, t1, fetches)<<" -> "<<ns_per_fetch(t1, t2, fetches)<<endl;
+    cerr<<"  shift + scale + add:    "<<ns_per_fetch(t2, t3, fetches)<<" -> "<<ns_per_fetch(t3, t4, fetches)<<endl;
+    //keeps the loops from being optimized away
+    cerr<<"  (checksum "<<px.values[Spectre::bins/2]<<")"<<endl;
+}
@@ -0,0 +1,43 @@
+#include "spectral.h"
+#include <cstring>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+//precompiles a set of per-wavelength PNG planes into a mmappable spectral texture
+int main(int argc, char ** argv) {
+    if(argc<3) {
+        cerr<<"Usage: "<<argv[0]<<" <png_format> <out.spc> [first_wvlen last_wvlen [rows|tiles|morton]]"<<endl;
+        cerr<<"  e.g. "<<argv[0]<<" textures/spectral/stars/%d.png textures/spectral/stars.spc"<<endl;
+        return 65;
+    }
+    int first = texture_wvlen_first, last = texture_wvlen_last;
+    if(argc>4) {
+        first = atoi(argv[3]);
+        last = atoi(argv[4]);
+    }
+    enum texel_layout layout = LAYOUT_MORTON;//the renderer's default texture_layout, so it maps the file as it is
+    if(argc>5) {
+        if(!strcmp(argv[5], "rows")) layout = LAYOUT_ROWS;
+        else if(!strcmp(argv[5], "tiles")) layout = LAYOUT_TILES;
+        else if(!strcmp(argv[5], "morton")) layout = LAYOUT_MORTON;
+        else {
+            cerr<<"Unknown layout \""<<argv[5]<<"\"."<<endl;
+            return 65;
+        }
+    }
+    bool complete;
+    uint64_t stamp = spectral_source_stamp(first, last, argv[1], complete);
+    if(!complete) {
+        cerr<<"Some of the source planes are missing."<<endl;
+        return 66;
+    }
+    cerr<<"Converting "<<argv[1]<<"..."<<endl;
+    QuantizedTexture tex(first, last, argv[1], layout);
+    if(!tex.write_cache(argv[2], stamp)) {
+        cerr<<"Could not write \""<<argv[2]<<"\"."<<endl;
+        return 73;
+    }
+    cerr<<tex.get_width()<<"x"<<tex.get_height()<<" texels, "<<TexSpectre::bins<<" bins each, "<<texel_layout_name(layout)<<" layout, saved to \""<<argv[2]<<"\"."<<endl;
+}
@@ -0,0 +1,76 @@
+#ifndef _TEXSIM_H
+#define _TEXSIM_H
+
+//texel fetch cache simulation for the TEXSIM build (make bin/main_texsim): every fetch from a registered texture is
+//replayed through a simulated L1, L2 and TLB, so texture layouts can be compared where perf is not available.
+//the caches are shared by all threads without locking, so the counts only mean something with 1 thread.
+
+#include <stdint.h>
+#include <cstddef>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+//set-associative cache of lines of 1<<line_bits bytes with LRU replacement
+struct SimCache {
+    unsigned sets, ways, line_bits;
+    std::vector<uint64_t> tags, used;
+    uint64_t clock, misses;
+    SimCache(size_t size, unsigned w, unsigned lb) : ways(w), line_bits(lb), clock(0), misses(0) {
+        sets = (size>>line_bits)/ways;
+        tags.assign(sets*ways, ~0ull);
+        used.assign(sets*ways, 0);
+    }
+    void touch (uint64_t line) {
+        uint64_t* t = &tags[(line%sets)*ways];
+        uint64_t* u = &used[(line%sets)*ways];
+        unsigned victim = 0;
+        ++clock;
+        for(unsigned i=0; i<ways; ++i) {
+            if(t[i] == line) {
+                u[i] = clock;
+                return;
+            }
+            if(u[i] < u[victim]) victim = i;
+        }
+        ++misses;
+        t[victim] = line;
+        u[victim] = clock;
+    }
+    //every line of [p, p+n)
+    void touch_range (uintptr_t p, size_t n) {
+        for(uintptr_t l = p>>line_bits; l <= (p+n-1)>>line_bits; ++l) touch(l);
+    }
+};
+
+struct TexSim {
+    SimCache l1, l2, tlb;//32 KB 8-way, 1 MB 16-way, 64 pages of 4 KB 4-way
+    std::vector<std::pair<uintptr_t, uintptr_t> > ranges;
+    bool on;
+    uint64_t fetches;
+    TexSim() : l1(32768, 8, 6), l2(1<<20, 16, 6), tlb(64*4096, 4, 12), on(false), fetches(0) {}
+    //texel storage to count fetches from; anything else (the framebuffer, say) goes through the same accessors
+    void add (const void* p, size_t n) {
+        if(n) ranges.push_back(std::make_pair(reinterpret_cast<uintptr_t>(p), reinterpret_cast<uintptr_t>(p) + n));
+    }
+    void touch (const void* p, size_t n) {
+        if(!on) return;
+        uintptr_t a = reinterpret_cast<uintptr_t>(p);
+        bool texel = false;
+        for(size_t i=0; i<ranges.size(); ++i) {
+            texel |= a >= ranges[i].first && a < ranges[i].second;
+        }
+        if(!texel) return;
+        ++fetches;
+        l1.touch_range(a, n);
+        l2.touch_range(a, n);
+        tlb.touch_range(a, n);
+    }
+    void report () {
+        std::cerr<<"Texel fetches: "<<fetches<<", simulated misses: L1 "<<l1.misses<<", L2 "<<l2.misses<<", TLB "<<tlb.misses<<std::endl;
+    }
+};
+
+static TexSim texsim;
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef _TRANSFER_H
+#define _TRANSFER_H
+
+#include "orbit.h"
+#include "workpool.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Transfer table: the tracer's orbits, computed once for every render. In units of r_s the orbit equation is
+//w'' = kappa*exp(w) - w with kappa = a^2/2, a = r_s/C (see BinetOrbit), and nothing else: GM and the camera only pick a and
+//the point w0 = r_s/r0 where the ray starts on its orbit. So the table holds, for a grid of a, the orbit coming in from
+//infinity (w = 0, w' = a at phi = 0) up to its turning point (escaping) or the horizon (captured), and v = dw/da along it
+//(v'' = (kappa*exp(w) - 1)*v + a*exp(w), v(0) = 0, v'(0) = 1) for interpolating between rows. Past the turning point an
+//orbit is its own mirror image, and a ray heading outwards runs along the same curve backwards.
+
+//on-disk table: this header, the rows' summaries (end angle, its derivative in a, fate, w there) and then the samples
+//(w, w', v, v' every dphi along each row), all doubles, starting at data_offset
+struct TransferHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t rows;//a = a_max*x^2 with x = (i+0.5)/rows
+    uint32_t cols;//phi = j*dphi
+    uint32_t substeps;//RK4 steps per sample
+    double a_max;
+    double dphi;
+    uint64_t data_offset;
+};
+const char transfer_magic[8] = {'G','R','T','T','R','A','N','\0'};
+const uint32_t transfer_version = 1;
+const uint64_t transfer_data_offset = 4096;
+
+//quintic Hermite over [0, h] from values, slopes and second derivatives at both ends, at t in [0, 1]
+double hermite5(double a, double da, double dda, double b, double db, double ddb, double h, double t) {
+    double t2 = t*t, t3 = t2*t, t4 = t3*t, t5 = t4*t;
+    return (1 - 10*t3 + 15*t4 - 6*t5)*a + (t - 6*t3 + 8*t4 - 3*t5)*h*da + (t2 - 3*t3 + 3*t4 - t5)/2*h*h*dda
+        + (10*t3 - 15*t4 + 6*t5)*b + (-4*t3 + 7*t4 - 3*t5)*h*db + (t3 - 2*t4 + t5)/2*h*h*ddb;
+}
+
+//a ray looked up in the table: its start on the orbits of the two rows around its a, and how that moves with a
+struct TransferRay {
+    bool inbound;
+    int i;//rows i and i+1
+    double t, h;//a = a_i + t*h
+    double cam[2], dcam[2];//polar angle of the start on each row, and its derivative in a
+    double turn[2], dturn[2];//the rows' turning points (escaping rows), and their derivatives in a
+    enum ray_fate fate;
+    double end;//polar angle from the start, along the motion, where the ray escapes (the final direction) or falls in
+};
+
+//where a camera at w0 sits on each row, found once per frame: the lookup a ray would otherwise repeat
+struct TransferStarts {
+    double w0;
+    std::vector<double> cam, dcam;//polar angle on the row and its derivative in a, NAN where the row never reaches w0
+};
+
+class TransferTable {
+    private:
+        std::vector<double> own;//when built here rather than mapped
+        void* mapping;
+        size_t mapping_len;
+        const double* info;//4 per row
+        const double* samples;//4 per sample, cols per row
+        TransferHeader hdr;
+        TransferTable(const TransferTable&);
+        TransferTable& operator=(const TransferTable&);
+        static size_t samples_offset(const TransferHeader &h) {
+            return (h.data_offset + size_t(h.rows)*4*sizeof(double) + 63)/64*64;
+        }
+        size_t bytes() const {
+            return samples_offset(hdr) + size_t(hdr.rows)*hdr.cols*4*sizeof(double);
+        }
+        void release() {
+            if(mapping) munmap(mapping, mapping_len);
+            mapping = NULL;
+            mapping_len = 0;
+            own.clear();
+            info = samples = NULL;
+        }
+        //integrate row i into its summary and samples (NAN past a few samples after its end)
+        void build_row(int i, double* row_info, double* row) const {
+            const double a = row_a(i), kappa = a*a/2, h = hdr.dphi/hdr.substeps;
+            auto f = [&](const double* y, double* dy) {
+                double e = exp(y[0]);
+                dy[0] = y[1];
+                dy[1] = kappa*e - y[0];
+                dy[2] = y[3];
+                dy[3] = (kappa*e - 1)*y[2] + a*e;
+            };
+            auto step = [&](double* y, double h) {
+                double k1[4], k2[4], k3[4], k4[4], t[4];
+                f(y, k1);
+                for(int q=0; q<4; ++q) t[q] = y[q] + h/2*k1[q];
+                f(t, k2);
+                for(int q=0; q<4; ++q) t[q] = y[q] + h/2*k2[q];
+                f(t, k3);
+                for(int q=0; q<4; ++q) t[q] = y[q] + h*k3[q];
+                f(t, k4);
+                for(int q=0; q<4; ++q) y[q] += h/6*(k1[q] + 2*k2[q] + 2*k3[q] + k4[q]);
+            };
+            for(size_t k=0; k<size_t(hdr.cols)*4; ++k) row[k] = NAN;
+            row_info[0] = INFINITY;
+            row_info[1] = 0;
+            row_info[2] = NEAR_CRITICAL;
+            row_info[3] = NAN;
+            double y[4] = {0, a, 0, 1};
+            int past = 0;
+            for(unsigned j=0; j<hdr.cols && past < 3; ++j) {
+                for(int q=0; q<4; ++q) row[j*4 + q] = y[q];
+                if(row_info[2] != NEAR_CRITICAL) ++past;
+                for(unsigned sub=0; sub<hdr.substeps; ++sub) {
+                    double y0[4] = {y[0], y[1], y[2], y[3]};
+                    step(y, h);
+                    bool turns = y[1] <= 0, falls = y[0] >= 1;
+                    if(row_info[2] != NEAR_CRITICAL || !(turns || falls)) continue;
+                    //where within the step: bisect on the step length, redoing it from y0
+                    double lo = 0, hi = 1, yt[4];
+                    for(int k=0; k<48; ++k) {
+                        double mid = (lo+hi)/2;
+                        for(int q=0; q<4; ++q) yt[q] = y0[q];
+                        step(yt, mid*h);
+                        if(turns ? yt[1] > 0 : yt[0] < 1) lo = mid; else hi = mid;
+                    }
+                    for(int q=0; q<4; ++q) yt[q] = y0[q];
+                    step(yt, lo*h);
+                    row_info[0] = (j*hdr.substeps + sub + lo)*h;
+                    //the end moves with a as w' = 0 (resp. w = 1) does
+                    row_info[1] = turns ? -yt[3]/(kappa*exp(yt[0]) - yt[0]) : -yt[2]/yt[1];
+                    row_info[2] = turns ? ESCAPING : CAPTURED;
+                    row_info[3] = yt[0];
+                }
+            }
+        }
+        const double* sample(int i, int j) const {return samples + (size_t(i)*hdr.cols + j)*4;}
+        //w, dw/dphi and v on row i at polar angle phi; false outside the samples
+        bool at(int i, double phi, double &w, double &dw, double &v) const {
+            double x = phi/hdr.dphi;
+            int j = x;
+            if(phi < 0 || j >= int(hdr.cols)-1) return false;
+            const double* p = sample(i, j);
+            const double* q = p + 4;
+            if(q[0] != q[0]) return false;
+            double kappa = row_a(i)*row_a(i)/2;
+            double c0 = kappa*exp(p[0]) - p[0], c1 = kappa*exp(q[0]) - q[0];
+            double s = x - j;
+            w = hermite5(p[0], p[1], c0, q[0], q[1], c1, hdr.dphi, s);
+            dw = hermite(p[1], c0, q[1], c1, hdr.dphi, s);
+            v = hermite(p[2], p[3], q[2], q[3], hdr.dphi, s);
+            return true;
+        }
+        //polar angle where row i's incoming orbit reaches w0, and its derivative in a; false if it never does
+        bool place(int i, double w0, double &phi, double &dphi_da) const {
+            double end = info[4*i];
+            if(end == INFINITY || !(info[4*i+3] >= w0)) return false;
+            //last sample still below w0, then bisect the interpolant within its interval
+            int lo = 0, hi = int(end/hdr.dphi);
+            if(hi > int(hdr.cols)-2) hi = hdr.cols-2;
+            if(sample(i, hi)[0] < w0) lo = hi;
+            while(hi - lo > 1) {
+                int mid = (lo+hi)/2;
+                if(sample(i, mid)[0] < w0) lo = mid; else hi = mid;
+            }
+            //Newton from the chord, kept within the bracket (w' vanishes at the turning point)
+            double s0 = lo*hdr.dphi, s1 = (lo+1)*hdr.dphi < end ? (lo+1)*hdr.dphi : end;
+            double w, dw, v;
+            const double* p = sample(i, lo);
+            phi = s0 + (s1 - s0)*(w0 - p[0])/(p[4] - p[0]);
+            if(!(phi > s0 && phi < s1)) phi = (s0+s1)/2;
+            for(int k=0; k<64; ++k) {
+                if(!at(i, phi, w, dw, v)) return false;
+                if(w < w0) s0 = phi; else s1 = phi;
+                double next = phi - (w - w0)/dw;
+                if(!(next > s0 && next < s1)) next = (s0+s1)/2;
+                if(fabs(next - phi) < 1e-13 || s1 - s0 < 1e-13) break;
+                phi = next;
+            }
+            if(!at(i, phi, w, dw, v) || dw <= 0) return false;
+            dphi_da = -v/dw;
+            return true;
+        }
+    public:
+        TransferTable() {
+            mapping = NULL;
+            mapping_len = 0;
+            info = samples = NULL;
+            memset(&hdr, 0, sizeof(hdr));
+        }
+        ~TransferTable() {
+            release();
+        }
+        static TransferHeader header(unsigned rows, double a_max, unsigned per_pi, double phi_max, unsigned substeps) {
+            TransferHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, transfer_magic, sizeof(h.magic));
+            h.version = transfer_version;
+            h.rows = rows;
+            h.dphi = M_PI/per_pi;
+            h.cols = unsigned(ceil(phi_max/h.dphi)) + 1;
+            h.substeps = substeps;
+            h.a_max = a_max;
+            h.data_offset = transfer_data_offset;
+            return h;
+        }
+        //the grid every render asks for: rows up to a = 16 (closer to radial than that is left to live tracing),
+        //samples every pi/64 up to a turning point at 2*pi
+        static TransferHeader default_header() {
+            return header(8192, 16, 64, 2*M_PI, 2);
+        }
+        const TransferHeader& get_header() const {return hdr;}
+        double row_a(int i) const {
+            double x = (i+0.5)/hdr.rows;
+            return hdr.a_max*x*x;
+        }
+        //integrate all rows on threads workers
+        void build(const TransferHeader &h, unsigned threads) {
+            release();
+            hdr = h;
+            own.assign((bytes() - hdr.data_offset)/sizeof(double), NAN);
+            double* base = &own[0];
+            double* rows_info = base;
+            double* rows = base + (samples_offset(hdr) - hdr.data_offset)/sizeof(double);
+            run_tiled(hdr.rows, 1, 64, threads,
+                [&](const Tile &t, unsigned) {
+                    for(int i=t.x0; i<t.x1; ++i) {
+                        build_row(i, rows_info + 4*i, rows + size_t(i)*hdr.cols*4);
+                    }
+                }
+            );
+            info = rows_info;
+            samples = rows;
+        }
+        //through a temporary, like the texture caches
+        bool write(const char* fname) const {
+            char tmpname[2048];
+            snprintf(tmpname, sizeof(tmpname), "%s.tmp.%d", fname, int(getpid()));
+            FILE* f = fopen(tmpname, "wb");
+            if(!f) return false;
+            std::vector<char> pad(hdr.data_offset - sizeof(hdr), 0);
+            bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(&pad[0], pad.size(), 1, f) == 1;
+            ok = ok && fwrite(info, 1, bytes() - hdr.data_offset, f) == bytes() - hdr.data_offset;
+            ok = !fclose(f) && ok;
+            if(ok && !rename(tmpname, fname)) return true;
+            remove(tmpname);
+            return false;
+        }
+        //map a table built for exactly want
+        bool map(const char* fname, const TransferHeader &want) {
+            int fd = open(fname, O_RDONLY);
+            if(fd < 0) return false;
+            TransferHeader h;
+            struct stat st;
+            bool ok = read(fd, &h, sizeof(h)) == sizeof(h) && !fstat(fd, &st) && !memcmp(&h, &want, sizeof(h));
+            TransferHeader old = hdr;
+            hdr = h;
+            size_t len = bytes();
+            hdr = old;
+            ok = ok && size_t(st.st_size) >= len;
+            void* m = MAP_FAILED;
+            if(ok) {
+                m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if(m == MAP_FAILED) return false;
+            release();
+            hdr = h;
+            mapping = m;
+            mapping_len = len;
+            info = reinterpret_cast<const double*>(static_cast<char*>(m) + hdr.data_offset);
+            samples = reinterpret_cast<const double*>(static_cast<char*>(m) + samples_offset(hdr));
+            return true;
+        }
+        bool is_mapped() const {return mapping != NULL;}
+        enum ray_fate fate(int i) const {return (enum ray_fate)info[4*i+2];}
+        size_t size() const {return bytes();}
+        void place_all(double w0, TransferStarts &s) const {
+            s.w0 = w0;
+            s.cam.assign(hdr.rows, NAN);
+            s.dcam.assign(hdr.rows, NAN);
+            for(unsigned i=0; i<hdr.rows; ++i) {
+                if(fate(i) == NEAR_CRITICAL || !place(i, w0, s.cam[i], s.dcam[i])) {
+                    s.cam[i] = s.dcam[i] = NAN;
+                }
+            }
+        }
+        //the ray starting at s.w0 = r_s/r0 with a = r_s/C, inwards or not. tol bounds the interpolation error of the end angle,
+        //estimated as the difference between Hermite and linear interpolation across the rows. false if the rows around a do
+        //not both hold the ray (near-critical, too close to radial, or starting inside the turning point) or miss tol.
+        bool start(const TransferStarts &s, double a, bool inbound, double tol, TransferRay &r) const {
+            double x = sqrt(a/hdr.a_max)*hdr.rows - 0.5;
+            if(!(x >= 0) || x >= hdr.rows-1) return false;
+            r.i = x;
+            r.inbound = inbound;
+            double a0 = row_a(r.i), a1 = row_a(r.i+1);
+            r.h = a1 - a0;
+            r.t = (a - a0)/r.h;
+            double e[2], de[2];
+            for(int k=0; k<2; ++k) {
+                int i = r.i + k;
+                enum ray_fate fate = this->fate(i);
+                r.cam[k] = s.cam[i];
+                r.dcam[k] = s.dcam[i];
+                if(r.cam[k] != r.cam[k]) return false;
+                enum ray_fate ends = inbound ? fate : ESCAPING;
+                if(k && ends != r.fate) return false;
+                r.fate = ends;
+                r.turn[k] = fate == ESCAPING ? info[4*i] : INFINITY;
+                r.dturn[k] = fate == ESCAPING ? info[4*i+1] : 0;
+                if(!inbound) {//back the way it came in
+                    e[k] = r.cam[k];
+                    de[k] = r.dcam[k];
+                } else if(fate == ESCAPING) {//on to the turning point and out again
+                    e[k] = 2*r.turn[k] - r.cam[k];
+                    de[k] = 2*r.dturn[k] - r.dcam[k];
+                } else {//on to the horizon
+                    e[k] = info[4*i] - r.cam[k];
+                    de[k] = info[4*i+1] - r.dcam[k];
+                }
+            }
+            r.end = hermite(e[0], de[0], e[1], de[1], r.h, r.t);
+            return fabs(r.end - (e[0] + r.t*(e[1]-e[0]))) <= tol;
+        }
+        //w and its derivative along the motion at polar angle phi from the start of r (before its end); tol bounds the
+        //estimated relative error of w as in start()
+        bool radius_at(const TransferRay &r, double phi, double tol, double &w, double &dw) const {
+            double wk[2], sk[2], dk[2];
+            for(int k=0; k<2; ++k) {
+                int i = r.i + k;
+                double p, dp, ww, dww, v;
+                if(!r.inbound) {
+                    p = r.cam[k] - phi;
+                    dp = r.dcam[k];
+                } else if(r.cam[k] + phi > r.turn[k]) {//mirrored past the turning point
+                    p = 2*r.turn[k] - r.cam[k] - phi;
+                    dp = 2*r.dturn[k] - r.dcam[k];
+                } else {
+                    p = r.cam[k] + phi;
+                    dp = r.dcam[k];
+                }
+                if(!at(i, p, ww, dww, v)) return false;
+                bool backwards = !r.inbound || r.cam[k] + phi > r.turn[k];
+                wk[k] = ww;
+                sk[k] = v + dww*dp;
+                dk[k] = backwards ? -dww : dww;
+            }
+            w = hermite(wk[0], sk[0], wk[1], sk[1], r.h, r.t);
+            dw = dk[0] + r.t*(dk[1]-dk[0]);
+            return fabs(w - (wk[0] + r.t*(wk[1]-wk[0]))) <= tol*w;
+        }
+};
+
+#endif
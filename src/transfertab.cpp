@@ -0,0 +1,32 @@
+#include "transfer.h"
+#include <chrono>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+//precomputes the transfer table (see transfer.h) that "integrator transfer" maps at startup
+int main(int argc, char ** argv) {
+    if(argc<2) {
+        cerr<<"Usage: "<<argv[0]<<" <out.tbl> [threads]"<<endl;
+        cerr<<"  e.g. "<<argv[0]<<" textures/transfer.tbl"<<endl;
+        return 65;
+    }
+    unsigned threads = argc>2 && atoi(argv[2])>0 ? atoi(argv[2]) : default_thread_count();
+    TransferTable table;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    table.build(TransferTable::default_header(), threads);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    if(!table.write(argv[1])) {
+        cerr<<"Could not write \""<<argv[1]<<"\"."<<endl;
+        return 73;
+    }
+    int escaping = 0, captured = 0;
+    for(unsigned i=0; i<table.get_header().rows; ++i) {
+        enum ray_fate f = table.fate(i);
+        escaping += f == ESCAPING;
+        captured += f == CAPTURED;
+    }
+    cerr<<table.get_header().rows<<" orbits ("<<escaping<<" escaping, "<<captured<<" captured, the rest near-critical), "
+        <<table.size()/1048576<<" MB, built in "<<ms<<" ms on "<<threads<<" threads, saved to \""<<argv[1]<<"\"."<<endl;
+}
@@ -0,0 +1,94 @@
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile {
+    int x0, y0; //first pixel (inclusive)
+    int x1, y1; //last pixel (exclusive)
+    Tile(int xa=0, int ya=0, int xb=0, int yb=0) {
+        x0 = xa; y0 = ya;
+        x1 = xb; y1 = yb;
+    }
+};
+
+//per-worker tile deque: the owner pops from the front, thieves take from the back
+class TileDeque {
+    private:
+        std::mutex lock;
+        std::deque<Tile> tiles;
+    public:
+        void push(const Tile& t) {
+            std::lock_guard<std::mutex> g(lock);
+            tiles.push_back(t);
+        }
+        bool pop(Tile& t) {
+            std::lock_guard<std::mutex> g(lock);
+            if(tiles.empty()) return false;
+            t = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+        bool steal(Tile& t) {
+            std::lock_guard<std::mutex> g(lock);
+            if(tiles.empty()) return false;
+            t = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+};
+
+unsigned default_thread_count() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+//split a height x width frame into tiles and run work(tile, thread_id) on a work-stealing pool.
+//every worker starts with a contiguous band of tiles; once it runs dry it steals from the others,
+//so expensive regions (around the hole) get shared out. no new tiles appear after startup,
+//so a worker is done as soon as a full sweep over all deques comes back empty.
+template<typename F> void run_tiled(int height, int width, int tile_size, unsigned nthreads, F work) {
+    if(nthreads < 1) nthreads = 1;
+    std::vector<Tile> all;
+    for(int x=0; x<height; x+=tile_size) {
+        for(int y=0; y<width; y+=tile_size) {
+            all.push_back(Tile(x, y, std::min(x+tile_size, height), std::min(y+tile_size, width)));
+        }
+    }
+    if(nthreads > all.size()) nthreads = all.size() ? all.size() : 1;
+
+    std::vector<TileDeque> queues(nthreads);
+    for(unsigned i=0; i<all.size(); ++i) {
+        queues[i*nthreads/all.size()].push(all[i]);
+    }
+
+    auto worker = [&](unsigned id) {
+        Tile t;
+        for(;;) {
+            bool got = queues[id].pop(t);
+            for(unsigned k=1; !got && k<nthreads; ++k) {
+                got = queues[(id+k)%nthreads].steal(t);
+            }
+            if(!got) return;
+            work(t, id);
+        }
+    };
+
+    if(nthreads == 1) {//no need to spawn anything
+        worker(0);
+        return;
+    }
+    std::vector<std::thread> pool;
+    for(unsigned i=0; i<nthreads; ++i) {
+        pool.push_back(std::thread(worker, i));
+    }
+    for(unsigned i=0; i<nthreads; ++i) {
+        pool[i].join();
+    }
+}
+
+#endif